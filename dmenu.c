@@ -1,12 +1,22 @@
 /* See LICENSE file for copyright and license details. */
 #include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
 #include <locale.h>
+#include <poll.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
 #include <X11/Xlib.h>
 #include <X11/Xatom.h>
@@ -19,6 +29,7 @@
 /* Patch incompatibility overrides */
 
 #include "drw.h"
+#include "match.h"
 #include "util.h"
 
 /* macros */
@@ -39,33 +50,38 @@ enum {
 	SchemeLast,
 }; /* color schemes */
 
-struct item {
-	char *text;
-	char *stext;
-	struct item *left, *right;
-	int out;
-	double distance;
-};
-
 static char text[BUFSIZ] = "";
 static char pipeout[8] = " | dmenu";
 static char *embed;
 static int bh, mw, mh;
 static int inputw = 0, promptw;
 static int passwd = 0;
+static int fast = 0; /* -f: grab the keyboard before reading stdin */
 static int lrpad; /* sum of left and right padding */
 static int reject_no_match = 0;
 static size_t cursor;
-static struct item *items = NULL;
-static struct item *matches, *matchend;
+static unsigned int textx[sizeof text]; /* textx[i]: width of text[0, i) for i <= textxn */
+static size_t textxn;
+static pthread_t reader; /* reads stdin during startup, see readstart() */
+static int reading;
 static struct item *prev, *curr, *next, *sel;
 static int mon = -1, screen;
-static unsigned int sortmatches = 1;
 static unsigned int preselected = 0;
 
+/* damage tracking: what the last full redraw put on screen */
+static int fulldraw = 1;
+static struct item *drawncurr, *drawnsel;
+static int ndrawn; /* items on the last drawn page */
+static struct { int x, y, w; } *cells;
+static int ncells;
+
+/* work deferred until all queued events are handled, see run() */
+static int pendingmatch, pendingdraw;
+
 static Atom clip, utf8;
 static Display *dpy;
 static Window root, parentwin, win;
+static int parentw, parenth; /* size of parentwin, queried once in main() */
 static XIC xic;
 
 static Drw *drw;
@@ -82,11 +98,20 @@ textw_clamp(const char *str, unsigned int n)
 	return MIN(w, n);
 }
 
-static void appenditem(struct item *item, struct item **list, struct item **last);
 static void calcoffsets(void);
 static void cleanup(void);
-static char * cistrstr(const char *s, const char *sub);
+static void quit(int status);
+static void fail(const char *msg);
 static int drawitem(struct item *item, int x, int y, int w);
+static void textchanged(size_t pos);
+static unsigned int textwidth(size_t n);
+static void drawinput(int x, int w);
+static void drawnumbers(void);
+static void addcell(int i, int x, int y, int w);
+static void redrawitem(struct item *item);
+static void drawdamage(void);
+static int pageshift(void);
+static void drawscroll(int k);
 static void drawmenu(void);
 static void grabfocus(void);
 static void grabkeyboard(void);
@@ -95,30 +120,18 @@ static void insert(const char *str, ssize_t n);
 static size_t nextrune(int inc);
 static void movewordedge(int dir);
 static void keypress(XKeyEvent *ev);
+static void parseargs(int argc, char *argv[]);
 static void paste(void);
 static void readstdin(void);
+static void readfile(FILE *fp);
+static void readstart(void);
+static void readwait(void);
 static void run(void);
 static void setup(void);
 static void usage(void);
 
-static int (*fstrncmp)(const char *, const char *, size_t) = strncasecmp;
-static char *(*fstrstr)(const char *, const char *) = cistrstr;
-
 #include "patch/include.c"
 
-static void
-appenditem(struct item *item, struct item **list, struct item **last)
-{
-	if (*last)
-		(*last)->right = item;
-	else
-		*list = item;
-
-	item->left = *last;
-	item->right = NULL;
-	*last = item;
-}
-
 static void
 calcoffsets(void)
 {
@@ -144,33 +157,40 @@ cleanup(void)
 {
 	size_t i;
 
+	traceexit();
 	XUngrabKeyboard(dpy, CurrentTime);
 	for (i = 0; i < SchemeLast; i++)
 		free(scheme[i]);
-	for (i = 0; items && items[i].text; ++i) {
-		free(items[i].text);
-	}
-	free(items);
+	freeitems();
 	drw_free(drw);
 	XSync(dpy, False);
 	XCloseDisplay(dpy);
 }
 
-static char *
-cistrstr(const char *s, const char *sub)
+static void
+quit(int status)
 {
-	size_t len;
+	if (serving)
+		daemonreturn(status);
+	cleanup();
+	exit(status);
+}
 
-	for (len = strlen(sub); *s; s++)
-		if (!strncasecmp(s, sub, len))
-			return (char *)s;
-	return NULL;
+/* dies, or in daemon mode fails only the request being served */
+static void
+fail(const char *msg)
+{
+	if (!serving)
+		die("%s", msg);
+	fprintf(stderr, "%s\n", msg);
+	daemonreturn(1);
 }
 
 static int
 drawitem(struct item *item, int x, int y, int w)
 {
-	int r;
+	const unsigned int *spans;
+	unsigned int nspans;
 	char *text = item->stext;
 
 	if (item == sel)
@@ -180,59 +200,65 @@ drawitem(struct item *item, int x, int y, int w)
 	else
 		drw_setscheme(drw, scheme[SchemeNorm]);
 
-	r = drw_text(drw
+	nspans = highlightspans(item, &spans);
+	return drw_text_hl(drw
 		, x
 		, y
 		, w
 		, bh
 		, lrpad / 2
 		, text
-		, 0
+		, spans
+		, nspans
+		, scheme[item == sel ? SchemeSelHighlight : SchemeNormHighlight]
 		);
-	drawhighlights(item, x, y, w);
-	return r;
 }
 
+/* the widths in textx are stale from byte pos on */
 static void
-drawmenu(void)
+textchanged(size_t pos)
 {
-	unsigned int curpos;
-	struct item *item;
-	int x = 0, y = 0, w, rpad = 0, itw = 0, stw = 0;
-	int fh = drw->fonts->h;
-	char *censort;
+	textxn = MIN(textxn, pos);
+}
 
-	drw_setscheme(drw, scheme[SchemeNorm]);
-	drw_rect(drw, 0, 0, mw, mh, 1, 1);
+/* width of the first n bytes of the input text, n on a character boundary */
+static unsigned int
+textwidth(size_t n)
+{
+	if (n > textxn)
+		textxn = drw_fontset_getprefixw(drw, text, textxn, n, textx);
+	return textx[n];
+}
 
-	if (prompt && *prompt) {
-		x = drw_text(drw, x, 0, promptw, bh, lrpad / 2, prompt, 0
-		);
-	}
-	/* draw input field */
-	w = (lines > 0 || !matches) ? mw - x : inputw;
+static void
+drawinput(int x, int w)
+{
+	static char censort[sizeof text];
+	char vi_char[8] = "";
+	unsigned int curpos;
+	int fh = drw->fonts->h;
+	size_t len, n;
 
 	drw_setscheme(drw, scheme[SchemeNorm]);
 	if (passwd) {
-		censort = ecalloc(1, sizeof(text));
-		memset(censort, '.', strlen(text));
-		drw_text(drw, x, 0, w, bh, lrpad / 2, censort, 0
-		);
-		drw_text(drw, x, 0, w, bh, lrpad / 2, censort, 0
-		);
-		free(censort);
+		if (!censort[0])
+			memset(censort, '.', sizeof censort - 1);
+		len = strlen(text);
+		censort[len] = '\0';
+		drw_text(drw, x, 0, w, bh, lrpad / 2, censort, 0);
+		censort[len] = '.';
+		curpos = cursor * drw_fontset_getwidth(drw, ".");
 	} else {
-		drw_text(drw, x, 0, w, bh, lrpad / 2, text, 0
-		);
+		drw_text(drw, x, 0, w, bh, lrpad / 2, text, 0);
+		curpos = textwidth(cursor);
 	}
-
-	curpos = TEXTW(text) - TEXTW(&text[cursor]);
 	curpos += lrpad / 2 - 1;
 
 	if (using_vi_mode && text[0] != '\0') {
 		drw_setscheme(drw, scheme[SchemeCursor]);
-		char vi_char[] = {text[cursor], '\0'};
-		drw_text(drw, x + curpos, 0, TEXTW(vi_char) - lrpad, bh, 0, vi_char, 0);
+		n = text[cursor] ? nextrune(+1) : cursor;
+		memcpy(vi_char, &text[cursor], MIN(n - cursor, sizeof vi_char - 1));
+		drw_text(drw, x + curpos, 0, textwidth(n) - textwidth(cursor), bh, 0, vi_char, 0);
 	} else if (using_vi_mode) {
 		drw_setscheme(drw, scheme[SchemeNorm]);
 		drw_rect(drw, x + curpos, 2, lrpad / 2, bh - 4, 1, 0);
@@ -241,14 +267,158 @@ drawmenu(void)
 		drw_setscheme(drw, scheme[SchemeCaret]);
 		drw_rect(drw, x + curpos, 2 + (bh-fh)/2, 2, fh - 4, 1, 0);
 	}
+}
+
+static void
+drawnumbers(void)
+{
+	int w = TEXTW(numbers);
+
+	drw_setscheme(drw, scheme[SchemeNorm]);
+	drw_text(drw, mw - w - border_width, 0, w, bh, lrpad / 2, numbers, 0);
+}
+
+static void
+addcell(int i, int x, int y, int w)
+{
+	if (i >= ncells && !(cells = realloc(cells, (ncells = i + 16) * sizeof *cells)))
+		die("cannot realloc %zu bytes:", ncells * sizeof *cells);
+	cells[i].x = x;
+	cells[i].y = y;
+	cells[i].w = w;
+}
+
+/* redraws an item of the current page where the last full redraw put it */
+static void
+redrawitem(struct item *item)
+{
+	struct item *it;
+	int i;
+
+	for (i = 0, it = curr; it && it != next; it = it->right, i++)
+		if (it == item) {
+			drawitem(item, cells[i].x, cells[i].y, cells[i].w);
+			return;
+		}
+}
+
+/* Only the input field, the counter and the previously and currently
+ * selected items can change while the match set and page stay the same. */
+static void
+drawdamage(void)
+{
+	int x = (prompt && *prompt) ? promptw : 0, y0 = mh, y1 = 0, i;
+	struct item *it;
+
+	drawinput(x, (lines > 0 || !matches) ? mw - x : inputw);
+	drawnumbers();
+	if (drawnsel != sel)
+		redrawitem(drawnsel);
+	redrawitem(sel);
+	drw_map(drw, win, x, 0, mw - x, bh);
+
+	if (lines > 0) {
+		for (i = 0, it = curr; it && it != next; it = it->right, i++)
+			if (it == sel || it == drawnsel) {
+				y0 = MIN(y0, cells[i].y);
+				y1 = MAX(y1, cells[i].y + bh);
+			}
+		if (y0 < y1)
+			drw_map(drw, win, 0, y0, mw, y1 - y0);
+	}
+	drawnsel = sel;
+}
+
+/* rows the vertical page moved by since it was drawn, 0 if it shares
+ * none of them with the last one */
+static int
+pageshift(void)
+{
+	struct item *it;
+	int k;
+
+	for (k = 1, it = drawncurr; k < ndrawn && (it = it->right); k++)
+		if (it == curr)
+			return k;
+	for (k = 1, it = drawncurr; k < lines && (it = it->left); k++)
+		if (it == curr)
+			return -k;
+	return 0;
+}
+
+/* Moves the rows the last page shares with the current one by k rows and
+ * draws only the rows that scrolled in and the old and new selection. */
+static void
+drawscroll(int k)
+{
+	struct item *item = curr;
+	int x = (prompt && *prompt) ? promptw : 0, y, i, j;
+
+	if (k > 0)
+		drw_copy(drw, 0, bh * (1 + k), mw, bh * (ndrawn - k), 0, bh);
+	else
+		drw_copy(drw, 0, bh, mw, bh * MIN(ndrawn, lines + k), 0, bh * (1 - k));
+
+	pagehighlights();
+	for (i = 0; i < lines; i++) {
+		y = bh * (i + 1);
+		if (item == next) {
+			drw_setscheme(drw, scheme[SchemeNorm]);
+			drw_rect(drw, 0, y, mw, bh, 1, 1);
+			continue;
+		}
+		addcell(i, 0, y, mw);
+		j = i + k;
+		if (j < 0 || j >= ndrawn || item == sel || item == drawnsel)
+			drawitem(item, 0, y, mw);
+		item = item->right;
+	}
+	drawinput(x, mw - x);
+	drawnumbers();
+	drw_map(drw, win, 0, 0, mw, mh);
+	for (ndrawn = 0, item = curr; item != next; item = item->right)
+		ndrawn++;
+}
+
+static void
+drawmenu(void)
+{
+	struct item *item;
+	int x = 0, y = 0, w, rpad = 0, itw = 0, stw = 0, i = 0;
+
+	pendingdraw = 0;
+	if (!fulldraw && curr == drawncurr) {
+		drawdamage();
+		return;
+	}
+	if (!fulldraw && lines > 0 && (i = pageshift())) {
+		drawscroll(i);
+		drawncurr = curr;
+		drawnsel = sel;
+		return;
+	}
+
+	drw_setscheme(drw, scheme[SchemeNorm]);
+	drw_rect(drw, 0, 0, mw, mh, 1, 1);
 
+	if (prompt && *prompt) {
+		x = drw_text(drw, x, 0, promptw, bh, lrpad / 2, prompt, 0
+		);
+	}
+	/* draw input field */
+	w = (lines > 0 || !matches) ? mw - x : inputw;
+	drawinput(x, w);
+
+	pagehighlights();
 	recalculatenumbers();
 	rpad = TEXTW(numbers);
 	rpad += border_width;
 	if (lines > 0) {
 		/* draw vertical list */
-		for (item = curr; item != next; item = item->right)
-			drawitem(item, 0, y += bh, mw);
+		for (item = curr; item != next; item = item->right) {
+			addcell(i++, 0, y += bh, mw);
+			drawitem(item, 0, y, mw);
+		}
 	} else if (matches) {
 		/* draw horizontal list */
 		x += inputw;
@@ -262,6 +432,7 @@ drawmenu(void)
 		for (item = curr; item != next; item = item->right) {
 			stw = TEXTW(symbol_2);
 			itw = textw_clamp(item->stext, mw - x - stw - rpad);
+			addcell(i++, x, 0, itw);
 			x = drawitem(item, x, 0, itw);
 		}
 		if (next) {
@@ -273,50 +444,89 @@ drawmenu(void)
 			);
 		}
 	}
-	drw_setscheme(drw, scheme[SchemeNorm]);
-	drw_text(drw, mw - rpad, 0, TEXTW(numbers), bh, lrpad / 2, numbers, 0);
+	drawnumbers();
 	drw_map(drw, win, 0, 0, mw, mh);
+
+	fulldraw = 0;
+	ndrawn = i;
+	drawncurr = curr;
+	drawnsel = sel;
+}
+
+/* Waits at most ms milliseconds for an event in mask on window w. */
+static int
+waitevent(Window w, long mask, XEvent *ev, int ms)
+{
+	struct pollfd pfd = { .fd = ConnectionNumber(dpy), .events = POLLIN };
+	long long end = tracenow() + ms * 1000LL;
+	int left;
+
+	while (!XCheckWindowEvent(dpy, w, mask, ev)) {
+		if ((left = (end - tracenow()) / 1000) <= 0)
+			return 0;
+		poll(&pfd, 1, left);
+	}
+	return 1;
 }
 
 static void
 grabfocus(void)
 {
-	struct timespec ts = { .tv_sec = 0, .tv_nsec = 10000000  };
+	long long start = tracenow();
 	Window focuswin;
-	int i, revertwin;
+	XEvent ev;
+	int delay, revertwin;
 
-	for (i = 0; i < 100; ++i) {
+	tracebegin(TraceFocus);
+	/* wait for the FocusIn, retrying with backoff for at most a second */
+	for (delay = 1; ; delay = MIN(delay * 2, 16)) {
 		XGetInputFocus(dpy, &focuswin, &revertwin);
 		if (focuswin == win)
-			return;
+			break;
+		if (tracenow() - start > 1000000)
+			fail("cannot grab focus");
 		XSetInputFocus(dpy, win, RevertToParent, CurrentTime);
-		nanosleep(&ts, NULL);
+		if (waitevent(win, FocusChangeMask, &ev, delay) && ev.type == FocusIn)
+			break;
 	}
-	die("cannot grab focus");
+	traceend(TraceFocus);
 }
 
 static void
 grabkeyboard(void)
 {
-	struct timespec ts = { .tv_sec = 0, .tv_nsec = 1000000  };
-	int i;
+	long long start = tracenow();
+	XEvent ev;
+	int delay;
 
 	if (embed)
 		return;
-	/* try to grab keyboard, we may have to wait for another process to ungrab */
-	for (i = 0; i < 1000; i++) {
-		if (XGrabKeyboard(dpy, DefaultRootWindow(dpy), True, GrabModeAsync,
-		                  GrabModeAsync, CurrentTime) == GrabSuccess) {
-			return;
-		}
-		nanosleep(&ts, NULL);
+	tracebegin(TraceGrab);
+	/* Try to grab keyboard, we may have to wait for another process to
+	 * ungrab. Releasing a grab moves the focus back, so focus changes on
+	 * the root window cut the wait short. */
+	XSelectInput(dpy, root, FocusChangeMask);
+	for (delay = 1; XGrabKeyboard(dpy, root, True, GrabModeAsync,
+	                              GrabModeAsync, CurrentTime) != GrabSuccess;
+	     delay = MIN(delay * 2, 16)) {
+		if (tracenow() - start > 1000000)
+			fail("cannot grab keyboard");
+		waitevent(root, FocusChangeMask, &ev, delay);
 	}
-	die("cannot grab keyboard");
+	XSelectInput(dpy, root, NoEventMask);
+	while (XCheckWindowEvent(dpy, root, FocusChangeMask, &ev))
+		; /* NOP */
+	traceend(TraceGrab);
 }
 
 static void
 match(void)
 {
+	int best;
+
+	fulldraw = 1;
+	pendingmatch = 0;
+	hlgen++; /* the highlight spans are of the last input */
 	if (dynamic && *dynamic)
 		refreshoptions();
 
@@ -324,64 +534,12 @@ match(void)
 		fuzzymatch();
 		return;
 	}
-	static char **tokv = NULL;
-	static int tokn = 0;
-
-	char buf[sizeof text], *s;
-	int i, tokc = 0;
-	size_t len, textsize;
-	struct item *item, *lprefix, *lsubstr, *prefixend, *substrend;
-
-	strcpy(buf, text);
-	/* separate input text into tokens to be matched individually */
-	for (s = strtok(buf, " "); s; tokv[tokc - 1] = s, s = strtok(NULL, " "))
-		if (++tokc > tokn && !(tokv = realloc(tokv, ++tokn * sizeof *tokv)))
-			die("cannot realloc %zu bytes:", tokn * sizeof *tokv);
-	len = tokc ? strlen(tokv[0]) : 0;
-
-	matches = lprefix = lsubstr = matchend = prefixend = substrend = NULL;
-	textsize = strlen(text) + 1;
-	for (item = items; item && item->text; item++)
-	{
-		for (i = 0; i < tokc; i++)
-			if (!fstrstr(item->text, tokv[i]))
-				break;
-		if (i != tokc && !(dynamic && *dynamic)) /* not all tokens match */
-			continue;
-		/* exact matches go first, then prefixes, then substrings */
-		if (!sortmatches)
- 			appenditem(item, &matches, &matchend);
- 		else
-		if (!tokc || !fstrncmp(text, item->text, textsize))
-			appenditem(item, &matches, &matchend);
-		else if (!fstrncmp(tokv[0], item->text, len))
-			appenditem(item, &lprefix, &prefixend);
-		else
-			appenditem(item, &lsubstr, &substrend);
-	}
-	if (lprefix) {
-		if (matches) {
-			matchend->right = lprefix;
-			lprefix->left = matchend;
-		} else
-			matches = lprefix;
-		matchend = prefixend;
-	}
-	if (lsubstr)
-	{
-		if (matches) {
-			matchend->right = lsubstr;
-			lsubstr->left = matchend;
-		} else
-			matches = lsubstr;
-		matchend = substrend;
-	}
+	best = matchtext(text, dynamic && *dynamic);
 	curr = sel = matches;
 
-	if (instant && matches && matches==matchend && !lsubstr) {
+	if (instant && matches && matches==matchend && best) {
 		puts(matches->text);
-		cleanup();
-		exit(0);
+		quit(0);
 	}
 
 	calcoffsets();
@@ -400,13 +558,18 @@ insert(const char *str, ssize_t n)
 	}
 
 	/* move existing text out of the way, insert new text, and update cursor */
+	textchanged(cursor + MIN(n, 0));
 	memmove(&text[cursor + n], &text[cursor], sizeof text - cursor - MAX(n, 0));
 	if (n > 0)
 		memcpy(&text[cursor], str, n);
 	cursor += n;
+	if (!reject_no_match) {
+		pendingmatch = 1;
+		return;
+	}
 	match();
 
-	if (!matches && reject_no_match) {
+	if (!matches) {
 		/* revert to last text value if theres no match */
 		memcpy(text, last, BUFSIZ);
 		cursor -= n;
@@ -450,6 +613,13 @@ keypress(XKeyEvent *ev)
 	Status status;
 
 	len = XmbLookupString(xic, ev, buf, sizeof buf, &ksym, &status);
+	/* plain text edits can share one match() at the end of the event
+	 * batch, anything else may look at the matches of the current text */
+	if (pendingmatch && status != XLookupChars && (using_vi_mode
+	    || ev->state & (ControlMask | Mod1Mask)
+	    || (ksym != XK_BackSpace && ksym != XK_Delete && ksym != XK_KP_Delete
+	        && (len <= 0 || iscntrl((unsigned char)*buf)))))
+		match();
 	switch (status) {
 	default: /* XLookupNone, XBufferOverflow */
 		return;
@@ -494,6 +664,7 @@ keypress(XKeyEvent *ev)
 
 		case XK_k: /* delete right */
 			text[cursor] = '\0';
+			textchanged(cursor);
 			match();
 			break;
 		case XK_u: /* delete left */
@@ -529,8 +700,7 @@ keypress(XKeyEvent *ev)
 				break;
 			break;
 		case XK_bracketleft:
-			cleanup();
-			exit(1);
+			quit(1);
 		default:
 			return;
 		}
@@ -588,8 +758,7 @@ insert:
 		sel = matchend;
 		break;
 	case XK_Escape:
-		cleanup();
-		exit(1);
+		quit(1);
 	case XK_Home:
 	case XK_KP_Home:
 		if (sel == matches) {
@@ -611,7 +780,8 @@ insert:
 	case XK_Up:
 	case XK_KP_Up:
 		if (sel && sel->left && (sel = sel->left)->right == curr) {
-			curr = prev;
+			/* the vertical list scrolls by a row */
+			curr = lines > 0 ? sel : prev;
 			calcoffsets();
 		}
 		break;
@@ -634,8 +804,7 @@ insert:
 		if (restrict_return && (!sel || ev->state & (ShiftMask | ControlMask)))
 			break;
 		if (sel && !(ev->state & ShiftMask)){
-			cleanup();
-			exit(0);
+			quit(0);
 		}
 		if (!(ev->state & ControlMask)) {
 			if (sel->text[0] == startpipe[0]) {
@@ -645,6 +814,7 @@ insert:
 			puts(sel->text);
 		} else {
 			if (text[0] == startpipe[0]) {
+				textchanged(strlen(text));
 				strncpy(text + strlen(text),pipeout,8);
 				puts(text+1);
 			}
@@ -665,7 +835,7 @@ insert:
 	case XK_Down:
 	case XK_KP_Down:
 		if (sel && sel->right && (sel = sel->right) == next) {
-			curr = next;
+			curr = lines > 0 ? curr->right : next;
 			calcoffsets();
 		}
 		break;
@@ -673,6 +843,7 @@ insert:
 		if (!sel)
 			return;
 		cursor = strnlen(sel->text, sizeof text - 1);
+		textchanged(0);
 		memcpy(text, sel->text, cursor);
 		text[cursor] = '\0';
 		match();
@@ -687,7 +858,7 @@ draw:
 	if (using_vi_mode && text[cursor] == '\0')
 		--cursor;
 
-	drawmenu();
+	pendingdraw = 1;
 }
 
 static void
@@ -705,47 +876,149 @@ paste(void)
 		insert(p, (q = strchr(p, '\n')) ? q - p : (ssize_t)strlen(p));
 		XFree(p);
 	}
-	drawmenu();
+	pendingdraw = 1;
 }
 
 static void
 readstdin(void)
 {
-	char *line = NULL;
-	char *buf, *p;
-
-	size_t i, linesiz, itemsiz = 0;
-	ssize_t len;
-
 	if (passwd) {
 		inputw = lines = 0;
 		return;
 	}
+	readfile(stdin);
+}
 
-	/* read each line from stdin and add it to the item list */
-	for (i = 0; (len = getline(&line, &linesiz, stdin)) != -1; i++) {
-		if (i + 1 >= itemsiz) {
-			itemsiz += 256;
-			if (!(items = realloc(items, itemsiz * sizeof(*items))))
-				die("cannot realloc %zu bytes:", itemsiz * sizeof(*items));
-		}
-		if (line[len - 1] == '\n')
-			line[len - 1] = '\0';
-
-		if (!(items[i].text = strdup(line)))
-			die("strdup:");
-		if (!(buf = strdup(line)))
-			die("cannot strdup %u bytes:", strlen(line) + 1);
-		if ((p = strchr(buf, '\t')))
-			*p = '\0';
-		items[i].stext = buf;
-		items[i].out = 0;
+static void
+readfile(FILE *fp)
+{
+	size_t n = readitems(fp);
+
+	lines = MIN(lines, n);
+}
+
+static void *
+readthread(void *arg)
+{
+	tracebegin(TraceStdin);
+	if (pathsrc)
+		readpath();
+	else
+		readstdin();
+	traceend(TraceStdin);
+	return NULL;
+}
+
+/* Reads stdin on a helper thread while the main thread loads the fonts
+ * and colors. Nothing but the thread touches the items before readwait(). */
+static void
+readstart(void)
+{
+	if (!passwd && !pthread_create(&reader, NULL, readthread, NULL))
+		reading = 1;
+	else
+		readthread(NULL);
+}
+
+static void
+readwait(void)
+{
+	if (!reading)
+		return;
+	tracebegin(TraceStdinWait);
+	pthread_join(reader, NULL);
+	traceend(TraceStdinWait);
+	reading = 0;
+}
+
+static void
+parseargs(int argc, char *argv[])
+{
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (argv[i][0] == '\0')
+			continue;
 
+		/* these options take no arguments */
+		if (!strcmp(argv[i], "-v")) {      /* prints version information */
+			puts("dmenu-"VERSION);
+			quit(0);
+		} else if (!strcmp(argv[i], "-b")) { /* appears at the bottom of the screen */
+			topbar = 0;
+		} else if (!strcmp(argv[i], "-c")) { /* toggles centering of dmenu window on screen */
+			center = !center;
+		} else if (!strcmp(argv[i], "-f")) { /* grabs keyboard before reading stdin */
+			fast = 1;
+		} else if (!strcmp(argv[i], "-r")) { /* incremental */
+			incremental = !incremental;
+		} else if (!strcmp(argv[i], "-s")) { /* case-sensitive item matching */
+			fstrncmp = strncmp;
+			fstrstr = strstr;
+		} else if (!strcmp(argv[i], "-vi")) {
+			vi_mode = 1;
+			using_vi_mode = start_mode;
+			global_esc.ksym = XK_Escape;
+			global_esc.state = 0;
+		} else if (!strcmp(argv[i], "-n")) { /* instant select only match */
+			instant = !instant;
+		} else if (!strcmp(argv[i], "-F")) { /* disable/enable fuzzy matching, depends on default */
+			fuzzy = !fuzzy;
+		} else if (!strcmp(argv[i], "-P")) { /* is the input a password */
+			passwd = 1;
+		} else if (!strcmp(argv[i], "-R")) { /* reject input which results in no match */
+			reject_no_match = 1;
+		} else if (!strcmp(argv[i], "-S")) { /* do not sort matches */
+			sortmatches = 0;
+		} else if (!strcmp(argv[i], "-1")) {
+			restrict_return = 1;
+		} else if (!strcmp(argv[i], "-path")) { /* list the programs in $PATH */
+			pathsrc = 1;
+		} else if (i + 1 == argc)
+			usage();
+		/* these options take one argument */
+		else if (!strcmp(argv[i], "-l"))   /* number of lines in vertical list */
+			lines = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-m"))
+			mon = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-p"))   /* adds prompt to left of input field */
+			prompt = argv[++i];
+		else if (!strcmp(argv[i], "-fn"))  /* font or font set */
+			fonts[0] = argv[++i];
+		else if(!strcmp(argv[i], "-h")) { /* minimum height of one menu line */
+			lineheight = atoi(argv[++i]);
+			lineheight = MAX(lineheight, min_lineheight); /* reasonable default in case of value too small/negative */
+		}
+		else if (!strcmp(argv[i], "-nb"))  /* normal background color */
+			colors[SchemeNorm][ColBg] = argv[++i];
+		else if (!strcmp(argv[i], "-nf"))  /* normal foreground color */
+			colors[SchemeNorm][ColFg] = argv[++i];
+		else if (!strcmp(argv[i], "-sb"))  /* selected background color */
+			colors[SchemeSel][ColBg] = argv[++i];
+		else if (!strcmp(argv[i], "-sf"))  /* selected foreground color */
+			colors[SchemeSel][ColFg] = argv[++i];
+		else if (!strcmp(argv[i], "-nhb")) /* normal hi background color */
+			colors[SchemeNormHighlight][ColBg] = argv[++i];
+		else if (!strcmp(argv[i], "-nhf")) /* normal hi foreground color */
+			colors[SchemeNormHighlight][ColFg] = argv[++i];
+		else if (!strcmp(argv[i], "-shb")) /* selected hi background color */
+			colors[SchemeSelHighlight][ColBg] = argv[++i];
+		else if (!strcmp(argv[i], "-shf")) /* selected hi foreground color */
+			colors[SchemeSelHighlight][ColFg] = argv[++i];
+		else if (!strcmp(argv[i], "-ps"))   /* preselected item */
+			preselected = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-dy"))  /* dynamic command to run */
+			dynamic = argv[++i];
+		else if (!strcmp(argv[i], "-bw"))  /* border width around dmenu */
+			border_width = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-it")) {   /* adds initial text */
+			const char * text = argv[++i];
+			insert(text, strlen(text));
+		}
+		else {
+			usage();
+		}
 	}
-	free(line);
-	if (items)
-		items[i].text = NULL;
-	lines = MIN(lines, i);
 }
 
 static void
@@ -761,64 +1034,71 @@ run(void)
 					calcoffsets();
 				}
 			}
-			drawmenu();
+			pendingdraw = 1;
 			preselected = 0;
 		}
-		if (XFilterEvent(&ev, win))
-			continue;
-		switch(ev.type) {
-		case DestroyNotify:
-			if (ev.xdestroywindow.window != win)
+		/* handle everything queued so far, then match and draw once */
+		do {
+			if (XFilterEvent(&ev, win))
+				continue;
+			switch(ev.type) {
+			case DestroyNotify:
+				if (ev.xdestroywindow.window != win)
+					break;
+				quit(1);
+			case Expose:
+				if (ev.xexpose.count == 0) {
+					drw_map(drw, win, 0, 0, mw, mh);
+					tracedump(1);
+					tracebench();
+				}
 				break;
-			cleanup();
-			exit(1);
-		case Expose:
-			if (ev.xexpose.count == 0)
-				drw_map(drw, win, 0, 0, mw, mh);
-			break;
-		case FocusIn:
-			/* regrab focus from parent window */
-			if (ev.xfocus.window != win)
-				grabfocus();
-			break;
-		case KeyPress:
-			keypress(&ev.xkey);
-			break;
-		case SelectionNotify:
-			if (ev.xselection.property == utf8)
-				paste();
-			break;
-		case VisibilityNotify:
-			if (ev.xvisibility.state != VisibilityUnobscured)
-				XRaiseWindow(dpy, win);
-			break;
-		}
+			case FocusIn:
+				/* regrab focus from parent window */
+				if (ev.xfocus.window != win)
+					grabfocus();
+				break;
+			case KeyPress:
+				keypress(&ev.xkey);
+				break;
+			case SelectionNotify:
+				if (ev.xselection.property == utf8)
+					paste();
+				break;
+			case VisibilityNotify:
+				if (ev.xvisibility.state != VisibilityUnobscured)
+					XRaiseWindow(dpy, win);
+				break;
+			}
+		} while (XPending(dpy) && !XNextEvent(dpy, &ev));
+		if (!pendingmatch && !pendingdraw)
+			continue;
+		traceframe(0);
+		if (pendingmatch)
+			match();
+		if (pendingdraw)
+			drawmenu();
+		traceframe(1);
 	}
 }
 
 static void
 setup(void)
 {
-	int x, y, i, j;
+	int x, y, i;
 	unsigned int du;
 	XSetWindowAttributes swa;
 	XIM xim;
 	Window w, dw, *dws;
-	XWindowAttributes wa;
 	XClassHint ch = {"dmenu", "dmenu"};
 #ifdef XINERAMA
+	XWindowAttributes wa;
 	XineramaScreenInfo *info;
 	Window pw;
-	int a, di, n, area = 0;
+	int a, di, j, n, area = 0;
 #endif
-	/* init appearance */
-	for (j = 0; j < SchemeLast; j++)
-		scheme[j] = drw_scm_create(drw, (const char**)colors[j], 2);
-
-	clip = XInternAtom(dpy, "CLIPBOARD",   False);
-	utf8 = XInternAtom(dpy, "UTF8_STRING", False);
-
 	/* calculate menu geometry */
+	tracebegin(TraceGeometry);
 	bh = drw->fonts->h + 2;
 	bh = MAX(bh,lineheight);	/* make a menu line AT LEAST 'lineheight' tall */
 	lines = MAX(lines, 0);
@@ -826,11 +1106,15 @@ setup(void)
 	promptw = (prompt && *prompt) ? TEXTW(prompt) - lrpad / 4 : 0;
 #ifdef XINERAMA
 	i = 0;
+	tracebegin(TraceXinerama);
 	if (parentwin == root && (info = XineramaQueryScreens(dpy, &n))) {
-		XGetInputFocus(dpy, &w, &di);
+		/* the focus and pointer only matter with a choice of screens */
+		w = root;
 		if (mon >= 0 && mon < n)
 			i = mon;
-		else if (w != root && w != PointerRoot && w != None) {
+		else if (n > 1)
+			XGetInputFocus(dpy, &w, &di);
+		if (w != root && w != PointerRoot && w != None) {
 			/* find top-level window containing current input focus */
 			do {
 				if (XQueryTree(dpy, (pw = w), &dw, &w, &dws, &du) && dws)
@@ -845,7 +1129,7 @@ setup(void)
 					}
 		}
 		/* no focused window is on screen, so use pointer location instead */
-		if (mon < 0 && !area && XQueryPointer(dpy, root, &dw, &dw, &x, &y, &di, &di, &du))
+		if (mon < 0 && n > 1 && !area && XQueryPointer(dpy, root, &dw, &dw, &x, &y, &di, &di, &du))
 			for (i = 0; i < n; i++)
 				if (INTERSECT(x, y, 1, 1, info[i]) != 0)
 					break;
@@ -860,30 +1144,41 @@ setup(void)
 			mw = info[i].width;
 		}
 		XFree(info);
+		traceend(TraceXinerama);
 	} else
 #endif
 	{
-		if (!XGetWindowAttributes(dpy, parentwin, &wa))
-			die("could not get embedding window attributes: 0x%lx",
-			    parentwin);
+		traceend(TraceXinerama);
 		if (center) {
-			mw = MIN(MAX(max_textw() + promptw, min_width), wa.width);
-			x = (wa.width  - mw) / 2;
-			y = (wa.height - mh) / 2;
+			mw = MIN(MAX(max_textw() + promptw, min_width), parentw);
+			x = (parentw - mw) / 2;
+			y = (parenth - mh) / 2;
 		} else {
 			x = 0;
-			y = topbar ? 0 : wa.height - mh;
-			mw = wa.width;
+			y = topbar ? 0 : parenth - mh;
+			mw = parentw;
 		}
 	}
 	inputw = mw / 3; /* input width: ~33.33% of monitor width */
+	traceend(TraceGeometry);
 	match();
 
+	/* the daemon keeps its window and input context between menus */
+	if (win) {
+		XMoveResizeWindow(dpy, win, x, y - (topbar ? 0 : border_width * 2),
+		                  mw - border_width * 2, mh);
+		XSetWindowBorderWidth(dpy, win, border_width);
+		XSetWindowBackground(dpy, win, scheme[SchemeNorm][ColBg].pixel);
+		if (border_width)
+			XSetWindowBorder(dpy, win, scheme[SchemeBorder][ColBg].pixel);
+		goto map;
+	}
+
 	/* create menu window */
 	swa.override_redirect = True;
 	swa.background_pixel = scheme[SchemeNorm][ColBg].pixel;
 	swa.event_mask = ExposureMask | KeyPressMask | VisibilityChangeMask
-	;
+	               | FocusChangeMask;
 	win = XCreateWindow(
 		dpy, root,
 		x, y - (topbar ? 0 : border_width * 2), mw - border_width * 2, mh, border_width,
@@ -895,11 +1190,18 @@ setup(void)
 	XSetClassHint(dpy, win, &ch);
 
 	/* input methods */
-	if ((xim = XOpenIM(dpy, NULL, NULL, NULL)) == NULL)
-		die("XOpenIM failed: could not open input device");
+	tracebegin(TraceIM);
+	if ((xim = XOpenIM(dpy, NULL, NULL, NULL)) == NULL) {
+		XDestroyWindow(dpy, win);
+		win = 0; /* a daemon creates it again for the next menu */
+		fail("XOpenIM failed: could not open input device");
+	}
 
 	xic = XCreateIC(xim, XNInputStyle, XIMPreeditNothing | XIMStatusNothing,
 	                XNClientWindow, win, XNFocusWindow, win, NULL);
+	traceend(TraceIM);
+
+map:
 
 	XMapRaised(dpy, win);
 	if (embed) {
@@ -912,14 +1214,17 @@ setup(void)
 		}
 		grabfocus();
 	}
-	drw_resize(drw, mw, mh);
+	if (drw->w != mw || drw->h != mh)
+		drw_resize(drw, mw, mh);
+	tracebegin(TraceDraw);
 	drawmenu();
+	traceend(TraceDraw);
 }
 
 static void
 usage(void)
 {
-	die("usage: dmenu [-bv"
+	fputs("usage: dmenu [-bv"
 		"c"
 		"f"
 		"r"
@@ -931,7 +1236,7 @@ usage(void)
 		"R" // (changed from r to R due to conflict with INCREMENTAL_PATCH)
 		"1"
 		"] "
-		"[-vi] "
+		"[-vi] [-path] "
 		"[-l lines] [-p prompt] [-fn font] [-m monitor]"
 		"\n             [-nb color] [-nf color] [-sb color] [-sf color] [-w windowid]"
 		"\n            "
@@ -942,20 +1247,26 @@ usage(void)
 		" [-h height]"
 		" [-ps index]"
 		"\n             [-nhb color] [-nhf color] [-shb color] [-shf color]" // highlight colors
-		"\n");
+		"\n       dmenu -daemon [options]"
+		"\n", stderr);
+	quit(1);
 }
 
 int
 main(int argc, char *argv[])
 {
 	XWindowAttributes wa;
+	char *atomnames[] = { "CLIPBOARD", "UTF8_STRING" };
+	Atom atoms[LENGTH(atomnames)];
+	char cachepath[4096], *p;
 	int i;
-	int fast = 0;
 
+	tracebegin(TraceOpen);
 	if (!setlocale(LC_CTYPE, "") || !XSupportsLocale())
 		fputs("warning: no locale support\n", stderr);
 	if (!(dpy = XOpenDisplay(NULL)))
 		die("cannot open display");
+	traceend(TraceOpen);
 
 	/* These need to be checked before we init the visuals and read X resources. */
 	for (i = 1; i < argc; i++) {
@@ -965,6 +1276,8 @@ main(int argc, char *argv[])
 		} else if (!strcmp(argv[i], "-w")) {
 			argv[i][0] = '\0';
 			embed = strdup(argv[++i]);
+		} else if (!strcmp(argv[i], "-daemon")) {
+			daemonmode = 1;
 		} else {
 			continue;
 		}
@@ -975,101 +1288,43 @@ main(int argc, char *argv[])
 	root = RootWindow(dpy, screen);
 	if (!embed || !(parentwin = strtol(embed, NULL, 0)))
 		parentwin = root;
-	if (!XGetWindowAttributes(dpy, parentwin, &wa))
+	if (parentwin == root) {
+		/* the connection setup already told the root window size */
+		parentw = DisplayWidth(dpy, screen);
+		parenth = DisplayHeight(dpy, screen);
+	} else if (XGetWindowAttributes(dpy, parentwin, &wa)) {
+		parentw = wa.width;
+		parenth = wa.height;
+	} else {
 		die("could not get embedding window attributes: 0x%lx",
 		    parentwin);
+	}
 
-	drw = drw_create(dpy, screen, root, wa.width, wa.height);
+	drw = drw_create(dpy, screen, root, parentw, parenth);
+	tracebegin(TraceXresources);
 	readxresources();
+	traceend(TraceXresources);
 
-	for (i = 1; i < argc; i++) {
-		if (argv[i][0] == '\0')
-			continue;
+	parseargs(argc, argv);
 
-		/* these options take no arguments */
-		if (!strcmp(argv[i], "-v")) {      /* prints version information */
-			puts("dmenu-"VERSION);
-			exit(0);
-		} else if (!strcmp(argv[i], "-b")) { /* appears at the bottom of the screen */
-			topbar = 0;
-		} else if (!strcmp(argv[i], "-c")) { /* toggles centering of dmenu window on screen */
-			center = !center;
-		} else if (!strcmp(argv[i], "-f")) { /* grabs keyboard before reading stdin */
-			fast = 1;
-		} else if (!strcmp(argv[i], "-r")) { /* incremental */
-			incremental = !incremental;
-		} else if (!strcmp(argv[i], "-s")) { /* case-sensitive item matching */
-			fstrncmp = strncmp;
-			fstrstr = strstr;
-		} else if (!strcmp(argv[i], "-vi")) {
-			vi_mode = 1;
-			using_vi_mode = start_mode;
-			global_esc.ksym = XK_Escape;
-			global_esc.state = 0;
-		} else if (!strcmp(argv[i], "-n")) { /* instant select only match */
-			instant = !instant;
-		} else if (!strcmp(argv[i], "-F")) { /* disable/enable fuzzy matching, depends on default */
-			fuzzy = !fuzzy;
-		} else if (!strcmp(argv[i], "-P")) { /* is the input a password */
-			passwd = 1;
-		} else if (!strcmp(argv[i], "-R")) { /* reject input which results in no match */
-			reject_no_match = 1;
-		} else if (!strcmp(argv[i], "-S")) { /* do not sort matches */
-			sortmatches = 0;
-		} else if (!strcmp(argv[i], "-1")) {
-			restrict_return = 1;
-		} else if (i + 1 == argc)
-			usage();
-		/* these options take one argument */
-		else if (!strcmp(argv[i], "-l"))   /* number of lines in vertical list */
-			lines = atoi(argv[++i]);
-		else if (!strcmp(argv[i], "-m"))
-			mon = atoi(argv[++i]);
-		else if (!strcmp(argv[i], "-p"))   /* adds prompt to left of input field */
-			prompt = argv[++i];
-		else if (!strcmp(argv[i], "-fn"))  /* font or font set */
-			fonts[0] = argv[++i];
-		else if(!strcmp(argv[i], "-h")) { /* minimum height of one menu line */
-			lineheight = atoi(argv[++i]);
-			lineheight = MAX(lineheight, min_lineheight); /* reasonable default in case of value too small/negative */
-		}
-		else if (!strcmp(argv[i], "-nb"))  /* normal background color */
-			colors[SchemeNorm][ColBg] = argv[++i];
-		else if (!strcmp(argv[i], "-nf"))  /* normal foreground color */
-			colors[SchemeNorm][ColFg] = argv[++i];
-		else if (!strcmp(argv[i], "-sb"))  /* selected background color */
-			colors[SchemeSel][ColBg] = argv[++i];
-		else if (!strcmp(argv[i], "-sf"))  /* selected foreground color */
-			colors[SchemeSel][ColFg] = argv[++i];
-		else if (!strcmp(argv[i], "-nhb")) /* normal hi background color */
-			colors[SchemeNormHighlight][ColBg] = argv[++i];
-		else if (!strcmp(argv[i], "-nhf")) /* normal hi foreground color */
-			colors[SchemeNormHighlight][ColFg] = argv[++i];
-		else if (!strcmp(argv[i], "-shb")) /* selected hi background color */
-			colors[SchemeSelHighlight][ColBg] = argv[++i];
-		else if (!strcmp(argv[i], "-shf")) /* selected hi foreground color */
-			colors[SchemeSelHighlight][ColFg] = argv[++i];
-		else if (!strcmp(argv[i], "-ps"))   /* preselected item */
-			preselected = atoi(argv[++i]);
-		else if (!strcmp(argv[i], "-dy"))  /* dynamic command to run */
-			dynamic = argv[++i];
-		else if (!strcmp(argv[i], "-bw"))  /* border width around dmenu */
-			border_width = atoi(argv[++i]);
-		else if (!strcmp(argv[i], "-it")) {   /* adds initial text */
-			const char * text = argv[++i];
-			insert(text, strlen(text));
-		}
-		else {
-			usage();
-		}
-	}
+	if (!daemonmode && !(dynamic && *dynamic))
+		readstart();
 
+	if ((p = getenv("XDG_CACHE_HOME")) && *p)
+		snprintf(cachepath, sizeof(cachepath), "%s/dmenu/fonts", p);
+	else if ((p = getenv("HOME")))
+		snprintf(cachepath, sizeof(cachepath), "%s/.cache/dmenu/fonts", p);
+	if (p)
+		drw_fontcache(drw, cachepath);
+	tracebegin(TraceFonts);
 	if (!drw_fontset_create(drw, (const char**)fonts, LENGTH(fonts)))
 		die("no fonts could be loaded.");
+	traceend(TraceFonts);
 
 	lrpad = drw->fonts->h;
 
-	if (lineheight == -1)
+	/* the daemon keeps -1 and works it out per request, for its fonts */
+	if (lineheight == -1 && !daemonmode)
 		lineheight = drw->fonts->h * 2.5;
 
 #ifdef __OpenBSD__
@@ -1077,13 +1332,23 @@ main(int argc, char *argv[])
 		die("pledge");
 #endif
 
+	/* init appearance */
+	for (i = 0; i < SchemeLast; i++)
+		scheme[i] = drw_scm_create(drw, (const char**)colors[i], 2);
+
+	/* one round trip for both atoms */
+	XInternAtoms(dpy, atomnames, LENGTH(atomnames), False, atoms);
+	clip = atoms[0];
+	utf8 = atoms[1];
+
+	if (daemonmode)
+		daemonrun(); /* does not return */
+
 	if (fast && !isatty(0)) {
 		grabkeyboard();
-		if (!(dynamic && *dynamic))
-			readstdin();
+		readwait();
 	} else {
-		if (!(dynamic && *dynamic))
-			readstdin();
+		readwait();
 		grabkeyboard();
 	}
 	setup();
@@ -0,0 +1,74 @@
+/* See LICENSE file for copyright and license details. */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "util.h"
+
+/* runs dmenu itself when no daemon can take the request */
+static void
+fallback(char *argv[])
+{
+	argv[0] = "dmenu";
+	execvp(argv[0], argv);
+	die("execvp %s:", argv[0]);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct sockaddr_un sa = { .sun_family = AF_UNIX };
+	int fds[3] = { 0, 1, 2 };
+	char cbuf[CMSG_SPACE(sizeof(fds))], *buf, *p;
+	struct iovec iov;
+	struct msghdr msg = { 0 };
+	struct cmsghdr *cm;
+	unsigned char status;
+	uint32_t len = 0;
+	ssize_t r;
+	int fd = -1, i;
+
+	if (daemonpath(sa.sun_path, sizeof(sa.sun_path)) < 0 ||
+	    (fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+	    connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+		fallback(argv);
+	/* our terminal only goes to a daemon of our own */
+	if (!samepeer(fd)) {
+		fprintf(stderr, "dmenuc: %s belongs to another user, running dmenu\n", sa.sun_path);
+		fallback(argv);
+	}
+
+	for (i = 1; i < argc; i++)
+		len += strlen(argv[i]) + 1;
+	p = buf = ecalloc(1, len + 1);
+	for (i = 1; i < argc; i++)
+		p = stpcpy(p, argv[i]) + 1;
+
+	/* the header carries our stdin, stdout and stderr */
+	iov.iov_base = &len;
+	iov.iov_len = sizeof(len);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+	if (sendmsg(fd, &msg, 0) != sizeof(len))
+		fallback(argv);
+	for (p = buf; p < buf + len; p += r)
+		if ((r = write(fd, p, buf + len - p)) < 0)
+			die("write:");
+
+	if (read(fd, &status, 1) != 1)
+		die("dmenuc: the daemon went away");
+	if (status == 255)
+		fallback(argv);
+	return status;
+}
@@ -1,14 +1,33 @@
 /* See LICENSE file for copyright and license details. */
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <X11/Xlib.h>
 #include <X11/Xft/Xft.h>
+#ifdef XSHM
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <X11/extensions/XShm.h>
+#endif
 
 #include "drw.h"
 #include "util.h"
 
 #define UTF_INVALID 0xFFFD
+#ifndef RGBTXT
+#define RGBTXT "/usr/share/X11/rgb.txt"
+#endif
+#define FNTMAP_NONE 1 /* no font covers the code point */
+
+unsigned long drw_xftcalls; /* calls into Xft, reported by DMENU_TRACE */
+
+static void fontmap_reset(Drw *drw);
+static void pixmap_create(Drw *drw, unsigned int w, unsigned int h);
+static void fontcache_free(struct Fntcache *c);
 
 static int
 utf8decode(const char *s_in, long *u, int *err)
@@ -46,6 +65,354 @@ utf8decode(const char *s_in, long *u, int *err)
 	return len;
 }
 
+#ifdef XSHM
+typedef struct {
+	XftFont *font;
+	FT_UInt index;
+	int left, top;
+	unsigned int w, h;
+	unsigned char *alpha; /* w * h coverage values, NULL for blank glyphs */
+	int color; /* from a color font, only Xft draws these */
+} Shmglyph;
+
+/* client-side back buffer in a MIT-SHM segment; text is rasterized with
+ * FreeType and the damaged parts are pushed with XShmPutImage */
+struct Shm {
+	XImage *img;
+	XShmSegmentInfo info;
+	unsigned long putserial;
+	Window putwin;
+	int shift[3]; /* red, green and blue offsets in a pixel */
+	Shmglyph *glyphs;
+	unsigned int glyphsz, glyphn;
+};
+
+static int shmfailed;
+
+static int
+xerrorshm(Display *dpy, XErrorEvent *ee)
+{
+	shmfailed = 1;
+	return 0;
+}
+
+static int
+maskshift(unsigned long mask)
+{
+	int i;
+
+	for (i = 0; mask && !(mask & 1); i++)
+		mask >>= 1;
+	return mask == 0xff ? i : -1;
+}
+
+static void
+shm_detach(Drw *drw)
+{
+	struct Shm *shm = drw->shm;
+
+	if (!shm->img)
+		return;
+	XShmDetach(drw->dpy, &shm->info);
+	shmdt(shm->info.shmaddr);
+	shm->img->data = NULL;
+	XDestroyImage(shm->img);
+	shm->img = NULL;
+}
+
+/* Attaches a w x h segment; only 32 bit TrueColor pixels with 8 bit
+ * channels are handled, anything else keeps the pixmap path. */
+static int
+shm_attach(Drw *drw, unsigned int w, unsigned int h)
+{
+	struct Shm *shm = drw->shm;
+	Visual *vis = DefaultVisual(drw->dpy, drw->screen);
+	int (*xerrorxlib)(Display *, XErrorEvent *);
+	XImage *img;
+
+	if (vis->class != TrueColor
+	|| (shm->shift[0] = maskshift(vis->red_mask)) < 0
+	|| (shm->shift[1] = maskshift(vis->green_mask)) < 0
+	|| (shm->shift[2] = maskshift(vis->blue_mask)) < 0)
+		return 0;
+	img = XShmCreateImage(drw->dpy, vis, DefaultDepth(drw->dpy, drw->screen),
+	                      ZPixmap, NULL, &shm->info, w, h);
+	if (!img)
+		return 0;
+	if (img->bits_per_pixel != 32
+	|| (shm->info.shmid = shmget(IPC_PRIVATE, img->bytes_per_line * img->height,
+	                             IPC_CREAT | 0600)) < 0) {
+		XDestroyImage(img);
+		return 0;
+	}
+	shm->info.shmaddr = img->data = shmat(shm->info.shmid, NULL, 0);
+	/* the segment goes away once both sides detached */
+	shmctl(shm->info.shmid, IPC_RMID, NULL);
+	if (shm->info.shmaddr == (char *)-1) {
+		img->data = NULL;
+		XDestroyImage(img);
+		return 0;
+	}
+	shm->info.readOnly = False;
+
+	/* attaching fails for remote servers even if they advertise MIT-SHM */
+	XSync(drw->dpy, False);
+	shmfailed = 0;
+	xerrorxlib = XSetErrorHandler(xerrorshm);
+	XShmAttach(drw->dpy, &shm->info);
+	XSync(drw->dpy, False);
+	XSetErrorHandler(xerrorxlib);
+	if (shmfailed) {
+		shmdt(shm->info.shmaddr);
+		img->data = NULL;
+		XDestroyImage(img);
+		return 0;
+	}
+	shm->img = img;
+	shm->putserial = 0;
+	return 1;
+}
+
+static void
+shm_glyphs_clear(struct Shm *shm)
+{
+	unsigned int i;
+
+	for (i = 0; i < shm->glyphsz; i++)
+		free(shm->glyphs[i].alpha);
+	free(shm->glyphs);
+	shm->glyphs = NULL;
+	shm->glyphsz = shm->glyphn = 0;
+}
+
+/* the completion of the last image put, not of an earlier one in the
+ * same frame */
+static Bool
+shm_completed(Display *dpy, XEvent *ev, XPointer arg)
+{
+	struct Shm *shm = (struct Shm *)arg;
+
+	return ev->type == XShmGetEventBase(dpy) + ShmCompletion
+	    && ((XShmCompletionEvent *)ev)->drawable == shm->putwin
+	    && ((XShmCompletionEvent *)ev)->serial >= shm->putserial;
+}
+
+/* The server may still be reading the last image put, it sends a
+ * ShmCompletion when done. Once it is known to have processed a later
+ * request it is done too, and the event loop may have taken the event. */
+static void
+shm_wait(Drw *drw)
+{
+	XEvent ev;
+
+	if (drw->shm->putserial && LastKnownRequestProcessed(drw->dpy) < drw->shm->putserial)
+		XIfEvent(drw->dpy, &ev, shm_completed, (XPointer)drw->shm);
+	drw->shm->putserial = 0;
+}
+
+/* Moves to the pixmap for the rest of the session, keeping what is drawn
+ * so far; taken when a color glyph, which only Xft draws, shows up. */
+static void
+shm_disable(Drw *drw)
+{
+	pixmap_create(drw, drw->w, drw->h);
+	XShmPutImage(drw->dpy, drw->drawable, drw->gc, drw->shm->img,
+	             0, 0, 0, 0, drw->w, drw->h, False);
+	shm_detach(drw);
+	shm_glyphs_clear(drw->shm);
+	free(drw->shm);
+	drw->shm = NULL;
+}
+
+static void
+shm_fill(Drw *drw, unsigned long pixel, int x, int y, int w, int h)
+{
+	XImage *img = drw->shm->img;
+	unsigned int *p;
+	int i;
+
+	if (x < 0)
+		w += x, x = 0;
+	if (y < 0)
+		h += y, y = 0;
+	w = MIN(w, img->width - x);
+	h = MIN(h, img->height - y);
+	for (; h > 0; h--, y++)
+		for (p = (unsigned int *)(img->data + y * img->bytes_per_line) + x, i = 0; i < w; i++)
+			p[i] = pixel;
+}
+
+static Shmglyph *
+shm_glyph(Drw *drw, XftFont *font, FT_UInt index)
+{
+	struct Shm *shm = drw->shm;
+	Shmglyph *g, *old;
+	FT_Face face;
+	FT_Bitmap *bm;
+	unsigned int i, j, n, oldsz;
+
+	if (shm->glyphsz) {
+		for (i = ((unsigned long)font >> 4 ^ index * 2654435761u) & (shm->glyphsz - 1);
+		     shm->glyphs[i].font; i = (i + 1) & (shm->glyphsz - 1))
+			if (shm->glyphs[i].font == font && shm->glyphs[i].index == index)
+				return &shm->glyphs[i];
+	}
+
+	if (2 * (shm->glyphn + 1) > shm->glyphsz) {
+		old = shm->glyphs;
+		oldsz = shm->glyphsz;
+		shm->glyphsz = oldsz ? 2 * oldsz : 256;
+		shm->glyphs = ecalloc(shm->glyphsz, sizeof(Shmglyph));
+		for (n = 0; n < oldsz; n++) {
+			if (!old[n].font)
+				continue;
+			for (i = ((unsigned long)old[n].font >> 4 ^ old[n].index * 2654435761u) & (shm->glyphsz - 1);
+			     shm->glyphs[i].font; i = (i + 1) & (shm->glyphsz - 1))
+				; /* NOP */
+			shm->glyphs[i] = old[n];
+		}
+		free(old);
+	}
+	for (i = ((unsigned long)font >> 4 ^ index * 2654435761u) & (shm->glyphsz - 1);
+	     shm->glyphs[i].font; i = (i + 1) & (shm->glyphsz - 1))
+		; /* NOP */
+	g = &shm->glyphs[i];
+	g->font = font;
+	g->index = index;
+	shm->glyphn++;
+
+	drw_xftcalls++;
+	if (!(face = XftLockFace(font)))
+		return g;
+	/* color bitmap fonts are not rasterized here */
+	g->color = FT_HAS_COLOR(face);
+	if (!g->color && !FT_Load_Glyph(face, index, FT_LOAD_DEFAULT | FT_LOAD_RENDER)) {
+		bm = &face->glyph->bitmap;
+		if ((bm->pixel_mode == FT_PIXEL_MODE_GRAY || bm->pixel_mode == FT_PIXEL_MODE_MONO)
+		&& bm->width && bm->rows) {
+			g->left = face->glyph->bitmap_left;
+			g->top = face->glyph->bitmap_top;
+			g->w = bm->width;
+			g->h = bm->rows;
+			g->alpha = ecalloc(g->w * g->h, 1);
+			for (j = 0; j < g->h; j++)
+				for (i = 0; i < g->w; i++)
+					if (bm->pixel_mode == FT_PIXEL_MODE_GRAY)
+						g->alpha[j * g->w + i] = bm->buffer[j * bm->pitch + i];
+					else if (bm->buffer[j * bm->pitch + i / 8] & (0x80 >> (i % 8)))
+						g->alpha[j * g->w + i] = 0xff;
+		}
+	}
+	XftUnlockFace(font);
+	return g;
+}
+
+/* returns 0 for a color glyph, which it cannot draw */
+static int
+shm_draw(Drw *drw, Clr *clr, XftFont *font, FT_UInt index, int x, int y)
+{
+	struct Shm *shm = drw->shm;
+	XImage *img = shm->img;
+	Shmglyph *g = shm_glyph(drw, font, index);
+	unsigned int *p, a, c, d, v, fg[3];
+	int i, j, k, px, py;
+
+	if (g->color)
+		return 0;
+	if (!g->alpha)
+		return 1;
+	fg[0] = clr->color.red >> 8;
+	fg[1] = clr->color.green >> 8;
+	fg[2] = clr->color.blue >> 8;
+	x += g->left;
+	y -= g->top;
+	for (j = MAX(0, -y); j < (int)g->h && (py = y + j) < img->height; j++) {
+		p = (unsigned int *)(img->data + py * img->bytes_per_line);
+		for (i = MAX(0, -x); i < (int)g->w && (px = x + i) < img->width; i++) {
+			if (!(a = g->alpha[j * g->w + i]))
+				continue;
+			if (a == 0xff) {
+				p[px] = clr->pixel;
+				continue;
+			}
+			for (v = p[px], k = 0; k < 3; k++) {
+				d = v >> shm->shift[k] & 0xff;
+				c = (fg[k] * a + d * (0xff - a) + 0x7f) / 0xff;
+				v = (v & ~(0xffu << shm->shift[k])) | c << shm->shift[k];
+			}
+			p[px] = v;
+		}
+	}
+	return 1;
+}
+#endif
+
+static void
+fillrect(Drw *drw, unsigned long pixel, int x, int y, unsigned int w, unsigned int h)
+{
+#ifdef XSHM
+	if (drw->shm) {
+		shm_wait(drw);
+		shm_fill(drw, pixel, x, y, w, h);
+		return;
+	}
+#endif
+	XSetForeground(drw->dpy, drw->gc, pixel);
+	XFillRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w, h);
+}
+
+static void
+drawstring(Drw *drw, Clr *clr, XftFont *font, int x, int y, const char *s, int len)
+{
+#ifdef XSHM
+	XGlyphInfo ext;
+	FT_UInt glyph;
+	long cp;
+	int err, n;
+
+	if (drw->shm) {
+		shm_wait(drw);
+		for (; len > 0; s += n, len -= n) {
+			n = utf8decode(s, &cp, &err);
+			glyph = XftCharIndex(drw->dpy, font, cp);
+			XftGlyphExtents(drw->dpy, font, &glyph, 1, &ext);
+			drw_xftcalls += 2;
+			if (!shm_draw(drw, clr, font, glyph, x, y)) {
+				shm_disable(drw);
+				break;
+			}
+			x += ext.xOff;
+		}
+		if (drw->shm)
+			return;
+	}
+#endif
+	XftDrawStringUtf8(drw->xftdraw, clr, font, x, y, (XftChar8 *)s, len);
+	drw_xftcalls++;
+}
+
+static void
+drawglyphs(Drw *drw, Clr *clr, XftGlyphFontSpec *specs, int n)
+{
+#ifdef XSHM
+	int i;
+
+	if (drw->shm) {
+		shm_wait(drw);
+		for (i = 0; i < n; i++)
+			if (!shm_draw(drw, clr, specs[i].font, specs[i].glyph, specs[i].x, specs[i].y))
+				break;
+		if (i == n)
+			return;
+		shm_disable(drw);
+		specs += i;
+		n -= i;
+	}
+#endif
+	XftDrawGlyphFontSpec(drw->xftdraw, clr, specs, n);
+	drw_xftcalls++;
+}
+
 int
 utf8len(const char *c)
 {
@@ -54,6 +421,15 @@ utf8len(const char *c)
 	return utf8decode(c, &utf8codepoint, &utf8err);
 }
 
+static void
+pixmap_create(Drw *drw, unsigned int w, unsigned int h)
+{
+	drw->drawable = XCreatePixmap(drw->dpy, drw->root, w, h, DefaultDepth(drw->dpy, drw->screen));
+	drw->xftdraw = XftDrawCreate(drw->dpy, drw->drawable,
+	                             DefaultVisual(drw->dpy, drw->screen),
+	                             DefaultColormap(drw->dpy, drw->screen));
+}
+
 Drw *
 drw_create(Display *dpy, int screen, Window root, unsigned int w, unsigned int h)
 {
@@ -64,7 +440,17 @@ drw_create(Display *dpy, int screen, Window root, unsigned int w, unsigned int h
 	drw->root = root;
 	drw->w = w;
 	drw->h = h;
-	drw->drawable = XCreatePixmap(dpy, root, w, h, DefaultDepth(dpy, screen));
+#ifdef XSHM
+	if (XShmQueryExtension(dpy)) {
+		drw->shm = ecalloc(1, sizeof(struct Shm));
+		if (!shm_attach(drw, w, h)) {
+			free(drw->shm);
+			drw->shm = NULL;
+		}
+	}
+#endif
+	if (!drw->shm)
+		pixmap_create(drw, w, h);
 	drw->gc = XCreateGC(dpy, root, 0, NULL);
 	XSetLineAttributes(dpy, drw->gc, 1, LineSolid, CapButt, JoinMiter);
 
@@ -79,16 +465,48 @@ drw_resize(Drw *drw, unsigned int w, unsigned int h)
 
 	drw->w = w;
 	drw->h = h;
+	if (drw->xftdraw)
+		XftDrawDestroy(drw->xftdraw);
 	if (drw->drawable)
 		XFreePixmap(drw->dpy, drw->drawable);
-	drw->drawable = XCreatePixmap(drw->dpy, drw->root, w, h, DefaultDepth(drw->dpy, drw->screen));
+	drw->xftdraw = NULL;
+	drw->drawable = 0;
+#ifdef XSHM
+	if (drw->shm) {
+		shm_wait(drw);
+		shm_detach(drw);
+		if (!shm_attach(drw, w, h)) {
+			shm_glyphs_clear(drw->shm);
+			free(drw->shm);
+			drw->shm = NULL;
+		}
+	}
+#endif
+	if (!drw->shm)
+		pixmap_create(drw, w, h);
 }
 
 void
 drw_free(Drw *drw)
 {
-	XFreePixmap(drw->dpy, drw->drawable);
+	if (drw->fntcache)
+		fontcache_free(drw->fntcache);
+	if (drw->xftdraw)
+		XftDrawDestroy(drw->xftdraw);
+	if (drw->drawable)
+		XFreePixmap(drw->dpy, drw->drawable);
+#ifdef XSHM
+	if (drw->shm) {
+		shm_detach(drw);
+		shm_glyphs_clear(drw->shm);
+		free(drw->shm);
+		drw->shm = NULL;
+	}
+#endif
 	XFreeGC(drw->dpy, drw->gc);
+	fontmap_reset(drw);
+	free(drw->fontv);
+	free(drw->specs);
 	drw_fontset_free(drw->fonts);
 	free(drw);
 }
@@ -119,6 +537,7 @@ xfont_create(Drw *drw, const char *fontname, FcPattern *fontpattern)
 			return NULL;
 		}
 	} else if (fontpattern) {
+		drw_xftcalls++;
 		if (!(xfont = XftFontOpenPattern(drw->dpy, fontpattern))) {
 			fprintf(stderr, "error, cannot load font from pattern.\n");
 			return NULL;
@@ -147,6 +566,540 @@ xfont_free(Fnt *font)
 	free(font);
 }
 
+static unsigned int
+fntmap_hash(unsigned int cp)
+{
+	cp = ((cp >> 16) ^ cp) * 0x21F0AAAD;
+	cp = ((cp >> 15) ^ cp) * 0xD35A2D97;
+	return (cp >> 15) ^ cp;
+}
+
+/* Returns 0 for unresolved code points, FNTMAP_NONE when no font covers
+ * them and the index into drw->fontv plus 2 otherwise. */
+static unsigned short
+fntmap_get(Fntmap *map, long cp)
+{
+	unsigned int i;
+
+	if (cp <= 0xFFFF)
+		return map->bmp[cp >> 8] ? map->bmp[cp >> 8][cp & 0xFF] : 0;
+	if (!map->astralsz)
+		return 0;
+	for (i = fntmap_hash(cp) & (map->astralsz - 1); map->astral[i].cp;
+	     i = (i + 1) & (map->astralsz - 1))
+		if (map->astral[i].cp == cp)
+			return map->astral[i].font;
+	return 0;
+}
+
+static void
+fntmap_set(Fntmap *map, long cp, unsigned short font)
+{
+	Fntslot *old;
+	unsigned int i, oldsz;
+
+	if (cp <= 0xFFFF) {
+		if (!map->bmp[cp >> 8])
+			map->bmp[cp >> 8] = ecalloc(256, sizeof(unsigned short));
+		map->bmp[cp >> 8][cp & 0xFF] = font;
+		return;
+	}
+	/* keep the astral table at most half full */
+	if (2 * (map->astraln + 1) > map->astralsz) {
+		old = map->astral;
+		oldsz = map->astralsz;
+		map->astralsz = oldsz ? oldsz * 2 : 64;
+		map->astral = ecalloc(map->astralsz, sizeof(Fntslot));
+		map->astraln = 0;
+		for (i = 0; i < oldsz; i++)
+			if (old[i].cp)
+				fntmap_set(map, old[i].cp, old[i].font);
+		free(old);
+	}
+	for (i = fntmap_hash(cp) & (map->astralsz - 1); map->astral[i].cp && map->astral[i].cp != cp;
+	     i = (i + 1) & (map->astralsz - 1))
+		; /* NOP */
+	if (!map->astral[i].cp)
+		map->astraln++;
+	map->astral[i].cp = cp;
+	map->astral[i].font = font;
+}
+
+/* Forgets all code point decisions and fallback fonts and indexes the
+ * current fontset. */
+static void
+fontmap_reset(Drw *drw)
+{
+	Fntmap *map = &drw->fntmap;
+	Fnt *cur;
+	size_t i;
+
+	for (i = 0; i < LENGTH(map->bmp); i++) {
+		free(map->bmp[i]);
+		map->bmp[i] = NULL;
+	}
+	free(map->astral);
+	map->astral = NULL;
+	map->astralsz = map->astraln = 0;
+#ifdef XSHM
+	/* cached glyphs are keyed by fonts that may be freed now */
+	if (drw->shm)
+		shm_glyphs_clear(drw->shm);
+#endif
+
+	for (i = drw->fontsetn; i < drw->fontn; i++)
+		xfont_free(drw->fontv[i]);
+	drw->fontn = 0;
+	drw->ellipsisw = drw->invalidw = 0;
+	for (cur = drw->fonts; cur; cur = cur->next) {
+		if (drw->fontn == drw->fontsz &&
+		    !(drw->fontv = realloc(drw->fontv, (drw->fontsz += 8) * sizeof(Fnt *))))
+			die("cannot realloc %zu bytes:", drw->fontsz * sizeof(Fnt *));
+		drw->fontv[drw->fontn++] = cur;
+	}
+	drw->fontsetn = drw->fontn;
+}
+
+/* On-disk cache of font matches: the patterns fontconfig matched for the
+ * configured font names and, per code point, the fallback pattern covering
+ * it or that there is none. It is used only while the fontconfig files and
+ * font directories it was written with are unchanged. */
+typedef struct {
+	unsigned int cp;
+	int pat; /* index into pats, -1 if no font covers the code point */
+} Fntcachecp;
+
+struct Fntcache {
+	char *path;
+	unsigned long key;
+	int dirty, matched;
+	char *stamps;             /* mtimes of the fontconfig files as read */
+	char **names, **namepats; /* configured font names and their matches */
+	unsigned int nnames;
+	char **pats;              /* fallback patterns */
+	unsigned int npats;
+	Fntcachecp *cps;          /* sorted by code point */
+	unsigned int ncps, cpsz;
+	int *fontpat;             /* pattern of each fallback font in fontv */
+	unsigned int fontpatsz;
+};
+
+static char **
+strvadd(char **v, unsigned int n, const char *s)
+{
+	if (!(v = realloc(v, (n + 1) * sizeof(char *))))
+		die("cannot realloc %zu bytes:", (n + 1) * sizeof(char *));
+	if (!(v[n] = strdup(s)))
+		die("strdup:");
+	return v;
+}
+
+static unsigned long
+fontcache_hash(unsigned long h, const char *s)
+{
+	for (; *s; s++)
+		h = (h ^ (unsigned char)*s) * 16777619UL;
+	return (h ^ 0xff) * 16777619UL;
+}
+
+/* the resources and screen size hold the Xft defaults, such as the dpi,
+ * that went into matching the font names */
+static unsigned long
+fontcache_key(Drw *drw, const char *fonts[], size_t fontcount)
+{
+	unsigned long h = 2166136261UL;
+	const char *xrm;
+	char buf[64];
+	size_t i;
+
+	snprintf(buf, sizeof(buf), "%d %d %d %d",
+	         DisplayWidth(drw->dpy, drw->screen), DisplayHeight(drw->dpy, drw->screen),
+	         DisplayWidthMM(drw->dpy, drw->screen), DisplayHeightMM(drw->dpy, drw->screen));
+	h = fontcache_hash(h, buf);
+	if ((xrm = XResourceManagerString(drw->dpy)))
+		h = fontcache_hash(h, xrm);
+	for (i = 0; i < fontcount; i++)
+		h = fontcache_hash(h, fonts[i]);
+	return h;
+}
+
+static void
+fontcache_clear(struct Fntcache *c)
+{
+	unsigned int i;
+
+	for (i = 0; i < c->nnames; i++) {
+		free(c->names[i]);
+		free(c->namepats[i]);
+	}
+	for (i = 0; i < c->npats; i++)
+		free(c->pats[i]);
+	free(c->names);
+	free(c->namepats);
+	free(c->pats);
+	free(c->stamps);
+	c->names = c->namepats = c->pats = NULL;
+	c->stamps = NULL;
+	c->nnames = c->npats = c->ncps = 0;
+}
+
+static int
+fontcache_get(struct Fntcache *c, unsigned int cp, unsigned int *pos)
+{
+	unsigned int lo = 0, hi = c->ncps, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (c->cps[mid].cp < cp)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*pos = lo;
+	return lo < c->ncps && c->cps[lo].cp == cp;
+}
+
+static void
+fontcache_learn(struct Fntcache *c, unsigned int cp, int pat)
+{
+	unsigned int i;
+
+	if (fontcache_get(c, cp, &i)) {
+		if (c->cps[i].pat != pat) {
+			c->cps[i].pat = pat;
+			c->dirty = 1;
+		}
+		return;
+	}
+	if (c->ncps == c->cpsz) {
+		c->cpsz = c->cpsz ? 2 * c->cpsz : 64;
+		if (!(c->cps = realloc(c->cps, c->cpsz * sizeof(Fntcachecp))))
+			die("cannot realloc %zu bytes:", c->cpsz * sizeof(Fntcachecp));
+	}
+	memmove(&c->cps[i + 1], &c->cps[i], (c->ncps - i) * sizeof(Fntcachecp));
+	c->cps[i].cp = cp;
+	c->cps[i].pat = pat;
+	c->ncps++;
+	c->dirty = 1;
+}
+
+static int
+fontcache_addpat(struct Fntcache *c, FcPattern *pattern)
+{
+	FcChar8 *s;
+	unsigned int i;
+
+	if (!(s = FcNameUnparse(pattern)))
+		return -1;
+	for (i = 0; i < c->npats && strcmp(c->pats[i], (char *)s); i++)
+		; /* NOP */
+	if (i == c->npats)
+		c->pats = strvadd(c->pats, c->npats++, (char *)s);
+	free(s);
+	return i;
+}
+
+static void
+fontcache_setfont(struct Fntcache *c, unsigned int i, int pat)
+{
+	if (i >= c->fontpatsz) {
+		c->fontpatsz = i + 8;
+		if (!(c->fontpat = realloc(c->fontpat, c->fontpatsz * sizeof(int))))
+			die("cannot realloc %zu bytes:", c->fontpatsz * sizeof(int));
+	}
+	c->fontpat[i] = pat;
+}
+
+static void
+fontcache_setname(struct Fntcache *c, const char *name, Fnt *font)
+{
+	FcChar8 *s;
+	unsigned int i;
+
+	if (!(s = FcNameUnparse(font->xfont->pattern)))
+		return;
+	for (i = 0; i < c->nnames && strcmp(c->names[i], name); i++)
+		; /* NOP */
+	if (i == c->nnames) {
+		c->names = strvadd(c->names, c->nnames, name);
+		c->namepats = strvadd(c->namepats, c->nnames++, (char *)s);
+	} else {
+		free(c->namepats[i]);
+		if (!(c->namepats[i] = strdup((char *)s)))
+			die("strdup:");
+	}
+	free(s);
+	c->dirty = 1;
+}
+
+static void
+fontcache_load(struct Fntcache *c, unsigned long key)
+{
+	FILE *fp;
+	struct stat st;
+	char *line = NULL, *p, *q;
+	size_t sz = 0, stampslen = 0;
+	ssize_t len;
+	unsigned long k;
+	unsigned int cp;
+	long long sec;
+	long nsec;
+	int n, pat;
+
+	fontcache_clear(c);
+	c->key = key;
+	c->dirty = 1;
+	if (!(fp = fopen(c->path, "r")))
+		return;
+	if (getline(&line, &sz, fp) < 0 || sscanf(line, "dmenu-fonts 1 %lx", &k) != 1 || k != key)
+		goto invalid;
+	while ((len = getline(&line, &sz, fp)) > 0) {
+		if (line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (len < 2 || line[1] != ' ')
+			goto invalid;
+		p = line + 2;
+		switch (line[0]) {
+		case 's':
+			if (sscanf(p, "%lld %ld %n", &sec, &nsec, &n) != 2)
+				goto invalid;
+			if (stat(p + n, &st) < 0)
+				memset(&st, 0, sizeof(st));
+			if (st.st_mtim.tv_sec != sec || st.st_mtim.tv_nsec != nsec)
+				goto invalid;
+			if (!(c->stamps = realloc(c->stamps, stampslen + len + 2)))
+				die("cannot realloc %zu bytes:", stampslen + len + 2);
+			stampslen += sprintf(c->stamps + stampslen, "%s\n", line);
+			break;
+		case 'f':
+			if (!(q = strchr(p, '\t')))
+				goto invalid;
+			*q++ = '\0';
+			c->names = strvadd(c->names, c->nnames, p);
+			c->namepats = strvadd(c->namepats, c->nnames++, q);
+			break;
+		case 'p':
+			c->pats = strvadd(c->pats, c->npats++, p);
+			break;
+		case 'c':
+			if (sscanf(p, "%x %d", &cp, &pat) != 2 || pat < -1 || pat >= (int)c->npats)
+				goto invalid;
+			fontcache_learn(c, cp, pat);
+			break;
+		default:
+			goto invalid;
+		}
+	}
+	if (c->stamps) {
+		c->dirty = 0;
+		goto done;
+	}
+invalid:
+	fontcache_clear(c);
+done:
+	free(line);
+	fclose(fp);
+}
+
+static void
+fontcache_stamp(FILE *fp, FcStrList *list)
+{
+	struct stat st;
+	FcChar8 *s;
+
+	if (!list)
+		return;
+	while ((s = FcStrListNext(list))) {
+		if (stat((char *)s, &st) < 0)
+			memset(&st, 0, sizeof(st));
+		fprintf(fp, "s %lld %ld %s\n", (long long)st.st_mtim.tv_sec,
+		        (long)st.st_mtim.tv_nsec, (char *)s);
+	}
+	FcStrListDone(list);
+}
+
+/* written to a temporary file and renamed, concurrent runs keep
+ * whichever finished last */
+static void
+fontcache_save(struct Fntcache *c)
+{
+	FILE *fp;
+	char *tmp, *p;
+	size_t len;
+	unsigned int i;
+	int ok;
+
+	if (!c->dirty)
+		return;
+	len = strlen(c->path) + 32;
+	tmp = ecalloc(1, len);
+	strcpy(tmp, c->path);
+	if ((p = strrchr(tmp, '/')) && p != tmp) {
+		*p = '\0';
+		mkdir(tmp, 0700);
+	}
+	snprintf(tmp, len, "%s.%ld", c->path, (long)getpid());
+	if (!(fp = fopen(tmp, "w"))) {
+		free(tmp);
+		return;
+	}
+	fprintf(fp, "dmenu-fonts 1 %lx\n", c->key);
+	/* the loaded stamps still hold if fontconfig was not needed */
+	if (c->stamps && !c->matched) {
+		fputs(c->stamps, fp);
+	} else {
+		fontcache_stamp(fp, FcConfigGetConfigFiles(NULL));
+		fontcache_stamp(fp, FcConfigGetConfigDirs(NULL));
+		fontcache_stamp(fp, FcConfigGetFontDirs(NULL));
+	}
+	for (i = 0; i < c->nnames; i++)
+		fprintf(fp, "f %s\t%s\n", c->names[i], c->namepats[i]);
+	for (i = 0; i < c->npats; i++)
+		fprintf(fp, "p %s\n", c->pats[i]);
+	for (i = 0; i < c->ncps; i++)
+		fprintf(fp, "c %x %d\n", c->cps[i].cp, c->cps[i].pat);
+	ok = !ferror(fp);
+	if (fclose(fp) || !ok || rename(tmp, c->path) < 0)
+		unlink(tmp);
+	else
+		c->dirty = 0;
+	free(tmp);
+}
+
+static void
+fontcache_free(struct Fntcache *c)
+{
+	fontcache_save(c);
+	fontcache_clear(c);
+	free(c->cps);
+	free(c->fontpat);
+	free(c->path);
+	free(c);
+}
+
+/* opens a configured font from its cached match */
+static Fnt *
+fontcache_font(Drw *drw, const char *name)
+{
+	struct Fntcache *c = drw->fntcache;
+	FcPattern *match;
+	Fnt *font;
+	unsigned int i;
+
+	for (i = 0; i < c->nnames && strcmp(c->names[i], name); i++)
+		; /* NOP */
+	if (i == c->nnames || !(match = FcNameParse((FcChar8 *)c->namepats[i])))
+		return NULL;
+	if (!(font = xfont_create(drw, NULL, match))) {
+		FcPatternDestroy(match);
+		return NULL;
+	}
+	/* Refer to the comment in xfont_create. */
+	if (!(font->pattern = FcNameParse((FcChar8 *)name))) {
+		xfont_free(font);
+		return NULL;
+	}
+	return font;
+}
+
+/* Asks fontconfig for a font covering the code point, based on the
+ * pattern of the first font in the set. pat is set to the cache index of
+ * the font's pattern. */
+static Fnt *
+xfont_fallback(Drw *drw, long cp, int *pat)
+{
+	struct Fntcache *c = drw->fntcache;
+	unsigned int pos;
+	FcCharSet *fccharset;
+	FcPattern *fcpattern;
+	FcPattern *match;
+	XftResult result;
+	Fnt *font = NULL;
+
+	if (!drw->fonts->pattern) {
+		/* Refer to the comment in xfont_create for more information. */
+		die("the first font in the cache must be loaded from a font string.");
+	}
+
+	*pat = -1;
+	if (c && fontcache_get(c, cp, &pos)) {
+		if ((*pat = c->cps[pos].pat) < 0)
+			return NULL;
+		if ((match = FcNameParse((FcChar8 *)c->pats[*pat]))) {
+			drw_xftcalls++;
+			if ((font = xfont_create(drw, NULL, match)) &&
+			    XftCharExists(drw->dpy, font->xfont, cp))
+				return font;
+			if (font)
+				xfont_free(font);
+			else
+				FcPatternDestroy(match);
+		}
+		*pat = -1;
+		font = NULL;
+	}
+	if (c)
+		c->matched = 1;
+
+	fccharset = FcCharSetCreate();
+	FcCharSetAddChar(fccharset, cp);
+
+	fcpattern = FcPatternDuplicate(drw->fonts->pattern);
+	FcPatternAddCharSet(fcpattern, FC_CHARSET, fccharset);
+	FcPatternAddBool(fcpattern, FC_SCALABLE, FcTrue);
+
+	FcConfigSubstitute(NULL, fcpattern, FcMatchPattern);
+	FcDefaultSubstitute(fcpattern);
+	match = XftFontMatch(drw->dpy, drw->screen, fcpattern, &result);
+	drw_xftcalls += 2; /* and XftCharExists() below */
+
+	FcCharSetDestroy(fccharset);
+	FcPatternDestroy(fcpattern);
+
+	if (match && (font = xfont_create(drw, NULL, match)) &&
+	    !XftCharExists(drw->dpy, font->xfont, cp)) {
+		xfont_free(font);
+		font = NULL;
+	}
+	if (c && font)
+		*pat = fontcache_addpat(c, font->xfont->pattern);
+	return font;
+}
+
+/* Returns the font used to draw a code point: the first font of the set
+ * or an already loaded fallback covering it, otherwise a newly matched
+ * fallback. Code points no font covers are drawn with the first font. */
+static Fnt *
+xfont_lookup(Drw *drw, long cp)
+{
+	unsigned short font;
+	unsigned int i;
+	int pat;
+	Fnt *fallback;
+
+	if ((font = fntmap_get(&drw->fntmap, cp)))
+		return font == FNTMAP_NONE ? drw->fonts : drw->fontv[font - 2];
+
+	for (i = 0; i < drw->fontn; i++) {
+		drw_xftcalls++;
+		if (XftCharExists(drw->dpy, drw->fontv[i]->xfont, cp))
+			break;
+	}
+	if (i == drw->fontn && (fallback = xfont_fallback(drw, cp, &pat))) {
+		if (drw->fontn == drw->fontsz &&
+		    !(drw->fontv = realloc(drw->fontv, (drw->fontsz += 8) * sizeof(Fnt *))))
+			die("cannot realloc %zu bytes:", drw->fontsz * sizeof(Fnt *));
+		if (drw->fntcache)
+			fontcache_setfont(drw->fntcache, drw->fontn, pat);
+		drw->fontv[drw->fontn++] = fallback;
+	}
+	fntmap_set(&drw->fntmap, cp, i < drw->fontn ? i + 2 : FNTMAP_NONE);
+	if (drw->fntcache && i >= drw->fontsetn &&
+	    (i == drw->fontn || drw->fntcache->fontpat[i] >= 0))
+		fontcache_learn(drw->fntcache, cp, i < drw->fontn ? drw->fntcache->fontpat[i] : -1);
+	return i < drw->fontn ? drw->fontv[i] : drw->fonts;
+}
+
 Fnt*
 drw_fontset_create(Drw* drw, const char *fonts[], size_t fontcount)
 {
@@ -156,13 +1109,100 @@ drw_fontset_create(Drw* drw, const char *fonts[], size_t fontcount)
 	if (!drw || !fonts)
 		return NULL;
 
+	if (drw->fntcache)
+		fontcache_load(drw->fntcache, fontcache_key(drw, fonts, fontcount));
 	for (i = 1; i <= fontcount; i++) {
-		if ((cur = xfont_create(drw, fonts[fontcount - i], NULL))) {
+		if (drw->fntcache && (cur = fontcache_font(drw, fonts[fontcount - i]))) {
+			cur->next = ret;
+			ret = cur;
+		} else if ((cur = xfont_create(drw, fonts[fontcount - i], NULL))) {
+			if (drw->fntcache) {
+				drw->fntcache->matched = 1;
+				fontcache_setname(drw->fntcache, fonts[fontcount - i], cur);
+			}
 			cur->next = ret;
 			ret = cur;
 		}
 	}
-	return (drw->fonts = ret);
+	drw->fonts = ret;
+	fontmap_reset(drw);
+	return ret;
+}
+
+/* Keeps the font matches in the file at path across runs. Has to be set
+ * before the fontset is created. */
+void
+drw_fontcache(Drw *drw, const char *path)
+{
+	if (!drw || !path || drw->fntcache)
+		return;
+	drw->fntcache = ecalloc(1, sizeof(struct Fntcache));
+	if (!(drw->fntcache->path = strdup(path)))
+		die("strdup:");
+}
+
+/* Writes out what the font cache learned, for a process that does not
+ * get to drw_free. */
+void
+drw_fontcache_flush(Drw *drw)
+{
+	if (drw && drw->fntcache)
+		fontcache_save(drw->fntcache);
+}
+
+/* The fontset with its fallback fonts, code point map and font cache,
+ * set aside by drw_fontset_stash while another fontset is in use. */
+struct Fntstash {
+	Fnt *fonts;
+	Fnt **fontv;
+	unsigned int fontn, fontsetn, fontsz;
+	Fntmap fntmap;
+	unsigned int ellipsisw, invalidw;
+	struct Fntcache *fntcache;
+};
+
+/* Sets the fontset aside and leaves drw without fonts, the next fontset
+ * created is not cached on disk. */
+struct Fntstash *
+drw_fontset_stash(Drw *drw)
+{
+	struct Fntstash *s = ecalloc(1, sizeof(struct Fntstash));
+
+	s->fonts = drw->fonts;
+	s->fontv = drw->fontv;
+	s->fontn = drw->fontn;
+	s->fontsetn = drw->fontsetn;
+	s->fontsz = drw->fontsz;
+	s->fntmap = drw->fntmap;
+	s->ellipsisw = drw->ellipsisw;
+	s->invalidw = drw->invalidw;
+	s->fntcache = drw->fntcache;
+	drw->fonts = NULL;
+	drw->fontv = NULL;
+	drw->fontn = drw->fontsetn = drw->fontsz = 0;
+	memset(&drw->fntmap, 0, sizeof(drw->fntmap));
+	drw->ellipsisw = drw->invalidw = 0;
+	drw->fntcache = NULL;
+	return s;
+}
+
+/* Frees the fontset in use and puts back the one set aside in s. */
+void
+drw_fontset_restore(Drw *drw, struct Fntstash *s)
+{
+	fontmap_reset(drw); /* frees the fallback fonts */
+	free(drw->fontv);
+	drw_fontset_free(drw->fonts);
+	drw->fonts = s->fonts;
+	drw->fontv = s->fontv;
+	drw->fontn = s->fontn;
+	drw->fontsetn = s->fontsetn;
+	drw->fontsz = s->fontsz;
+	drw->fntmap = s->fntmap;
+	drw->ellipsisw = s->ellipsisw;
+	drw->invalidw = s->invalidw;
+	drw->fntcache = s->fntcache;
+	free(s);
 }
 
 void
@@ -174,15 +1214,93 @@ drw_fontset_free(Fnt *font)
 	}
 }
 
+static int
+hexdigits(const char *s, int n, unsigned int *v)
+{
+	int i;
+
+	for (*v = 0, i = 0; i < n; i++) {
+		if (!isxdigit((unsigned char)s[i]))
+			return 0;
+		*v = *v << 4 | (isdigit((unsigned char)s[i]) ? s[i] - '0' : (tolower((unsigned char)s[i]) - 'a' + 10));
+	}
+	return 1;
+}
+
+/* Parses the #rgb, rgb:r/g/b and rgb.txt color names XParseColor knows,
+ * without asking the server. */
+static int
+clr_parse(const char *name, XRenderColor *c)
+{
+	unsigned short *ch[] = { &c->red, &c->green, &c->blue };
+	unsigned int v, r, g, b;
+	char line[256], *p;
+	size_t len;
+	FILE *fp;
+	int i, n;
+
+	c->alpha = 0xffff;
+	if (name[0] == '#') {
+		/* #rgb to #rrrrggggbbbb, the digits are the high bits */
+		len = strlen(name + 1);
+		if (!len || len % 3 || len > 12)
+			return 0;
+		for (n = len / 3, i = 0; i < 3; i++) {
+			if (!hexdigits(name + 1 + i * n, n, &v))
+				return 0;
+			*ch[i] = v << (16 - 4 * n);
+		}
+		return 1;
+	}
+	if (!strncasecmp(name, "rgb:", 4)) {
+		/* rgb:r/g/b with 1 to 4 digits each, scaled to 16 bits */
+		for (p = (char *)name + 4, i = 0; i < 3; i++, p += n + 1) {
+			for (n = 0; p[n] && p[n] != '/'; n++)
+				; /* NOP */
+			if (n < 1 || n > 4 || (i < 2 ? p[n] != '/' : p[n] != '\0') ||
+			    !hexdigits(p, n, &v))
+				return 0;
+			*ch[i] = v * 0xffff / ((1 << 4 * n) - 1);
+		}
+		return 1;
+	}
+
+	if (!(fp = fopen(RGBTXT, "r")))
+		return 0;
+	while (fgets(line, sizeof(line), fp)) {
+		if (line[0] == '!' || sscanf(line, "%u %u %u %n", &r, &g, &b, &n) != 3)
+			continue;
+		p = line + n;
+		p[strcspn(p, "\r\n")] = '\0';
+		if (!strcasecmp(p, name)) {
+			c->red = r * 0x101;
+			c->green = g * 0x101;
+			c->blue = b * 0x101;
+			fclose(fp);
+			return 1;
+		}
+	}
+	fclose(fp);
+	return 0;
+}
+
+/* The pixel value of parsed colors is computed from the visual masks on
+ * TrueColor visuals, only other names and visuals ask the server. */
 void
 drw_clr_create(Drw *drw, Clr *dest, const char *clrname)
 {
+	Visual *visual;
+	Colormap cmap;
+	XRenderColor c;
+
 	if (!drw || !dest || !clrname)
 		return;
 
-	if (!XftColorAllocName(drw->dpy, DefaultVisual(drw->dpy, drw->screen),
-	                       DefaultColormap(drw->dpy, drw->screen),
-	                       clrname, dest))
+	visual = DefaultVisual(drw->dpy, drw->screen);
+	cmap = DefaultColormap(drw->dpy, drw->screen);
+	if (clr_parse(clrname, &c) && XftColorAllocValue(drw->dpy, visual, cmap, &c, dest))
+		return;
+	if (!XftColorAllocName(drw->dpy, visual, cmap, clrname, dest))
 		die("error, cannot allocate color '%s'", clrname);
 }
 
@@ -206,8 +1324,10 @@ drw_scm_create(Drw *drw, const char *clrnames[], size_t clrcount)
 void
 drw_setfontset(Drw *drw, Fnt *set)
 {
-	if (drw)
+	if (drw && drw->fonts != set) {
 		drw->fonts = set;
+		fontmap_reset(drw);
+	}
 }
 
 void
@@ -220,32 +1340,34 @@ drw_setscheme(Drw *drw, Clr *scm)
 void
 drw_rect(Drw *drw, int x, int y, unsigned int w, unsigned int h, int filled, int invert)
 {
+	unsigned long pixel;
+
 	if (!drw || !drw->scheme)
 		return;
-	XSetForeground(drw->dpy, drw->gc, invert ? drw->scheme[ColBg].pixel : drw->scheme[ColFg].pixel);
-	if (filled)
-		XFillRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w, h);
-	else
+	pixel = invert ? drw->scheme[ColBg].pixel : drw->scheme[ColFg].pixel;
+	if (filled) {
+		fillrect(drw, pixel, x, y, w, h);
+	} else if (drw->shm) {
+		fillrect(drw, pixel, x, y, w, 1);
+		fillrect(drw, pixel, x, y + h - 1, w, 1);
+		fillrect(drw, pixel, x, y, 1, h);
+		fillrect(drw, pixel, x + w - 1, y, 1, h);
+	} else {
+		XSetForeground(drw->dpy, drw->gc, pixel);
 		XDrawRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w - 1, h - 1);
+	}
 }
 
 int
 drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lpad, const char *text, int invert)
 {
 	int ty, ellipsis_x = 0;
-	unsigned int tmpw, ew, ellipsis_w = 0, ellipsis_len, hash, h0, h1;
-	XftDraw *d = NULL;
+	unsigned int tmpw, ew, ellipsis_w = 0, ellipsis_len;
 	Fnt *usedfont, *curfont, *nextfont;
 	int utf8strlen, utf8charlen, utf8err, render = x || y || w || h;
 	long utf8codepoint = 0;
 	const char *utf8str;
-	FcCharSet *fccharset;
-	FcPattern *fcpattern;
-	FcPattern *match;
-	XftResult result;
-	int charexists = 0, overflow = 0;
-	/* keep track of a couple codepoints for which we have no match. */
-	static unsigned int nomatches[128], ellipsis_width, invalid_width;
+	int overflow = 0;
 	static const char invalid[] = "�";
 	const char *ellipsis = "...";
 
@@ -255,138 +1377,202 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 	if (!render) {
 		w = invert ? invert : ~invert;
 	} else {
-		XSetForeground(drw->dpy, drw->gc, drw->scheme[invert ? ColFg : ColBg].pixel);
-		XFillRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w, h);
-		d = XftDrawCreate(drw->dpy, drw->drawable,
-		                  DefaultVisual(drw->dpy, drw->screen),
-		                  DefaultColormap(drw->dpy, drw->screen));
+		fillrect(drw, drw->scheme[invert ? ColFg : ColBg].pixel, x, y, w, h);
 		x += lpad;
 		w -= lpad;
 	}
 
 	usedfont = drw->fonts;
-	if (!ellipsis_width && render)
-		ellipsis_width = drw_fontset_getwidth(drw, ellipsis);
-	if (!invalid_width && render)
-		invalid_width = drw_fontset_getwidth(drw, invalid);
+	if (!drw->ellipsisw && render)
+		drw->ellipsisw = drw_fontset_getwidth(drw, ellipsis);
+	if (!drw->invalidw && render)
+		drw->invalidw = drw_fontset_getwidth(drw, invalid);
 	while (1) {
 		ew = ellipsis_len = utf8err = utf8strlen = 0;
 		utf8str = text;
 		nextfont = NULL;
 		while (*text) {
 			utf8charlen = utf8decode(text, &utf8codepoint, &utf8err);
-			for (curfont = drw->fonts; curfont; curfont = curfont->next) {
-				charexists = charexists || XftCharExists(drw->dpy, curfont->xfont, utf8codepoint);
-				if (charexists) {
-					drw_font_getexts(curfont, text, utf8charlen, &tmpw, NULL);
-					if (ew + ellipsis_width <= w) {
-						/* keep track where the ellipsis still fits */
-						ellipsis_x = x + ew;
-						ellipsis_w = w - ew;
-						ellipsis_len = utf8strlen;
-					}
-
-					if (ew + tmpw > w) {
-						overflow = 1;
-						/* called from drw_fontset_getwidth_clamp():
-						 * it wants the width AFTER the overflow
-						 */
-						if (!render)
-							x += tmpw;
-						else
-							utf8strlen = ellipsis_len;
-					} else if (curfont == usedfont) {
- 						text += utf8charlen;
-						utf8strlen += utf8err ? 0 : utf8charlen;
-						ew += utf8err ? 0 : tmpw;
- 					} else {
- 						nextfont = curfont;
- 					}
-					break;
-				}
+			/* invalid sequences are replaced below, never switch fonts for them */
+			curfont = utf8err ? usedfont : xfont_lookup(drw, utf8codepoint);
+			drw_font_getexts(curfont, text, utf8charlen, &tmpw, NULL);
+			if (ew + drw->ellipsisw <= w) {
+				/* keep track where the ellipsis still fits */
+				ellipsis_x = x + ew;
+				ellipsis_w = w - ew;
+				ellipsis_len = utf8strlen;
 			}
 
-			if (overflow || !charexists || nextfont || utf8err)
+			if (ew + tmpw > w) {
+				overflow = 1;
+				/* called from drw_fontset_getwidth_clamp():
+				 * it wants the width AFTER the overflow
+				 */
+				if (!render)
+					x += tmpw;
+				else
+					utf8strlen = ellipsis_len;
+			} else if (curfont == usedfont) {
+				text += utf8charlen;
+				utf8strlen += utf8err ? 0 : utf8charlen;
+				ew += utf8err ? 0 : tmpw;
+			} else {
+				nextfont = curfont;
+			}
+
+			if (overflow || nextfont || utf8err)
 				break;
-			else
-				charexists = 0;
 		}
 
 		if (utf8strlen) {
 			if (render) {
 				ty = y + (h - usedfont->h) / 2 + usedfont->xfont->ascent;
-				XftDrawStringUtf8(d, &drw->scheme[invert ? ColBg : ColFg],
-				                  usedfont->xfont, x, ty, (XftChar8 *)utf8str, utf8strlen);
- 			}
+				drawstring(drw, &drw->scheme[invert ? ColBg : ColFg],
+				           usedfont->xfont, x, ty, utf8str, utf8strlen);
+			}
 			x += ew;
 			w -= ew;
 		}
-		if (utf8err && (!render || invalid_width < w)) {
+		if (utf8err && (!render || drw->invalidw < w)) {
 			if (render)
 				drw_text(drw, x, y, w, h, 0, invalid, invert);
-			x += invalid_width;
-			w -= invalid_width;
+			x += drw->invalidw;
+			w -= drw->invalidw;
 		}
 		if (render && overflow && ellipsis_w)
 			drw_text(drw, ellipsis_x, y, ellipsis_w, h, 0, ellipsis, invert);
 
-		if (!*text || overflow) {
+		if (!*text || overflow)
 			break;
-		} else if (nextfont) {
-			charexists = 0;
+		else if (nextfont)
 			usedfont = nextfont;
-		} else {
-			/* Regardless of whether or not a fallback font is found, the
-			 * character must be drawn. */
-			charexists = 1;
-
-			hash = (unsigned int)utf8codepoint;
-			hash = ((hash >> 16) ^ hash) * 0x21F0AAAD;
-			hash = ((hash >> 15) ^ hash) * 0xD35A2D97;
-			h0 = ((hash >> 15) ^ hash) % LENGTH(nomatches);
-			h1 = (hash >> 17) % LENGTH(nomatches);
-			/* avoid expensive XftFontMatch call when we know we won't find a match */
-			if (nomatches[h0] == utf8codepoint || nomatches[h1] == utf8codepoint)
-				goto no_match;
-
-			fccharset = FcCharSetCreate();
-			FcCharSetAddChar(fccharset, utf8codepoint);
-
-			if (!drw->fonts->pattern) {
-				/* Refer to the comment in xfont_create for more information. */
-				die("the first font in the cache must be loaded from a font string.");
-			}
+	}
 
-			fcpattern = FcPatternDuplicate(drw->fonts->pattern);
-			FcPatternAddCharSet(fcpattern, FC_CHARSET, fccharset);
-			FcPatternAddBool(fcpattern, FC_SCALABLE, FcTrue);
-
-			FcConfigSubstitute(NULL, fcpattern, FcMatchPattern);
-			FcDefaultSubstitute(fcpattern);
-			match = XftFontMatch(drw->dpy, drw->screen, fcpattern, &result);
-
-			FcCharSetDestroy(fccharset);
-			FcPatternDestroy(fcpattern);
-
-			if (match) {
-				usedfont = xfont_create(drw, NULL, match);
-				if (usedfont && XftCharExists(drw->dpy, usedfont->xfont, utf8codepoint)) {
-					for (curfont = drw->fonts; curfont->next; curfont = curfont->next)
-						; /* NOP */
-					curfont->next = usedfont;
-				} else {
-					xfont_free(usedfont);
-					nomatches[nomatches[h0] ? h1 : h0] = utf8codepoint;
-no_match:
-					usedfont = drw->fonts;
-				}
-			}
+	return x + (render ? w : 0);
+}
+
+/* Draws text like drw_text() and additionally paints the byte ranges
+ * [hl[2 * i], hl[2 * i + 1]) of it in the colors of hlscm. The ranges
+ * have to be sorted and must not overlap. The line is laid out once and
+ * its glyphs are submitted with one call per color. */
+int
+drw_text_hl(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lpad,
+            const char *text, const unsigned int *hl, unsigned int nhl, Clr *hlscm)
+{
+	XftGlyphFontSpec *spec;
+	XGlyphInfo ext;
+	FT_UInt glyph;
+	Fnt *font;
+	long cp;
+	const char *s;
+	int err, len, ex = -1, hlx = -1, ishl, overflow = 0;
+	unsigned int cap, n = 0, hln = 0, i = 0, pen = 0, dotw, off;
+
+	if (!drw || !drw->scheme || !w || !text || !drw->fonts)
+		return 0;
+
+	/* normal glyphs fill the buffer from the front, highlighted ones from
+	 * the back, leaving room for the ellipsis */
+	if ((cap = strlen(text) + 3) > drw->specsz) {
+		drw->specsz = cap;
+		if (!(drw->specs = realloc(drw->specs, cap * sizeof(XftGlyphFontSpec))))
+			die("cannot realloc %zu bytes:", cap * sizeof(XftGlyphFontSpec));
+	}
+
+	fillrect(drw, drw->scheme[ColBg].pixel, x, y, w, h);
+	x += lpad;
+	w -= lpad;
+
+	font = xfont_lookup(drw, '.');
+	glyph = XftCharIndex(drw->dpy, font->xfont, '.');
+	XftGlyphExtents(drw->dpy, font->xfont, &glyph, 1, &ext);
+	drw_xftcalls += 2;
+	dotw = ext.xOff;
+
+	for (s = text; *s; s += len) {
+		len = utf8decode(s, &cp, &err);
+		font = xfont_lookup(drw, cp);
+		glyph = XftCharIndex(drw->dpy, font->xfont, cp);
+		XftGlyphExtents(drw->dpy, font->xfont, &glyph, 1, &ext);
+		drw_xftcalls += 2;
+		if (pen + 3 * dotw <= w)
+			ex = pen; /* keep track where the ellipsis still fits */
+		if (pen + ext.xOff > w) {
+			overflow = 1;
+			break;
+		}
+
+		for (off = s - text; i < nhl && hl[2 * i + 1] <= off; i++)
+			; /* NOP */
+		ishl = i < nhl && hl[2 * i] <= off;
+		if (ishl && hlx < 0) {
+			hlx = pen;
+		} else if (!ishl && hlx >= 0) {
+			fillrect(drw, hlscm[ColBg].pixel, x + hlx, y, pen - hlx, h);
+			hlx = -1;
 		}
+
+		spec = ishl ? &drw->specs[cap - ++hln] : &drw->specs[n++];
+		spec->font = font->xfont;
+		spec->glyph = glyph;
+		spec->x = x + pen;
+		spec->y = y + (h - font->h) / 2 + font->xfont->ascent;
+		pen += ext.xOff;
+	}
+	if (hlx >= 0) {
+		fillrect(drw, hlscm[ColBg].pixel, x + hlx, y, pen - hlx, h);
 	}
-	if (d)
-		XftDrawDestroy(d);
 
-	return x + (render ? w : 0);
+	if (overflow) {
+		/* cut the line where the ellipsis still fits */
+		for (; n && drw->specs[n - 1].x >= x + ex; n--)
+			; /* NOP */
+		for (; hln && drw->specs[cap - hln].x >= x + ex; hln--)
+			; /* NOP */
+		fillrect(drw, drw->scheme[ColBg].pixel, x + MAX(ex, 0), y, w - MAX(ex, 0), h);
+		font = xfont_lookup(drw, '.');
+		for (i = 0; ex >= 0 && i < 3; i++) {
+			spec = &drw->specs[n++];
+			spec->font = font->xfont;
+			spec->glyph = XftCharIndex(drw->dpy, font->xfont, '.');
+			drw_xftcalls++;
+			spec->x = x + ex + i * dotw;
+			spec->y = y + (h - font->h) / 2 + font->xfont->ascent;
+		}
+	}
+
+	if (n)
+		drawglyphs(drw, &drw->scheme[ColFg], drw->specs, n);
+	if (hln)
+		drawglyphs(drw, &hlscm[ColFg], &drw->specs[cap - hln], hln);
+
+	return x + w;
+}
+
+/* Moves a w x h area of the drawable from sx, sy to dx, dy. */
+void
+drw_copy(Drw *drw, int sx, int sy, unsigned int w, unsigned int h, int dx, int dy)
+{
+#ifdef XSHM
+	XImage *img;
+	unsigned int i, r;
+#endif
+
+	if (!drw)
+		return;
+#ifdef XSHM
+	if (drw->shm) {
+		img = drw->shm->img;
+		shm_wait(drw);
+		for (i = 0; i < h; i++) {
+			r = dy > sy ? h - 1 - i : i;
+			memmove(img->data + (dy + r) * img->bytes_per_line + dx * 4,
+			        img->data + (sy + r) * img->bytes_per_line + sx * 4, w * 4);
+		}
+		return;
+	}
+#endif
+	XCopyArea(drw->dpy, drw->drawable, drw->drawable, drw->gc, sx, sy, w, h, dx, dy);
 }
 
 void
@@ -395,8 +1581,17 @@ drw_map(Drw *drw, Window win, int x, int y, unsigned int w, unsigned int h)
 	if (!drw)
 		return;
 
+#ifdef XSHM
+	if (drw->shm) {
+		drw->shm->putserial = NextRequest(drw->dpy);
+		drw->shm->putwin = win;
+		XShmPutImage(drw->dpy, win, drw->gc, drw->shm->img, x, y, x, y, w, h, True);
+		XFlush(drw->dpy);
+		return;
+	}
+#endif
 	XCopyArea(drw->dpy, drw->drawable, win, drw->gc, x, y, w, h, x, y);
-	XSync(drw->dpy, False);
+	XFlush(drw->dpy);
 }
 
 unsigned int
@@ -416,6 +1611,34 @@ drw_fontset_getwidth_clamp(Drw *drw, const char *text, unsigned int n)
 	return MIN(n, tmp);
 }
 
+/* Stores the width of text[0, i) in x[i] for each character boundary i
+ * past from, up to the first one at or after to; bytes inside a character
+ * get the width up to its start. x[from] has to be set and from has to be
+ * a boundary. Returns the last boundary reached. */
+size_t
+drw_fontset_getprefixw(Drw *drw, const char *text, size_t from, size_t to, unsigned int *x)
+{
+	unsigned int w;
+	long cp;
+	int err, len, i;
+
+	if (!drw || !drw->fonts || !text)
+		return from;
+	if (!drw->invalidw)
+		drw->invalidw = drw_fontset_getwidth(drw, "�");
+	for (; from < to && text[from]; from += len) {
+		len = utf8decode(&text[from], &cp, &err);
+		if (err)
+			w = drw->invalidw;
+		else
+			drw_font_getexts(xfont_lookup(drw, cp), &text[from], len, &w, NULL);
+		for (i = 1; i < len; i++)
+			x[from + i] = x[from];
+		x[from + len] = x[from] + w;
+	}
+	return from;
+}
+
 void
 drw_font_getexts(Fnt *font, const char *text, unsigned int len, unsigned int *w, unsigned int *h)
 {
@@ -425,6 +1648,7 @@ drw_font_getexts(Fnt *font, const char *text, unsigned int len, unsigned int *w,
 		return;
 
 	XftTextExtentsUtf8(font->dpy, font->xfont, (XftChar8 *)text, len, &ext);
+	drw_xftcalls++;
 	if (w)
 		*w = ext.xOff;
 	if (h)
@@ -12,6 +12,17 @@ typedef struct Fnt {
 	struct Fnt *next;
 } Fnt;
 
+typedef struct {
+	unsigned int cp;
+	unsigned short font;
+} Fntslot;
+
+typedef struct {
+	unsigned short *bmp[256]; /* BMP code points, blocks of 256 allocated on use */
+	Fntslot *astral;          /* code points above the BMP, open addressing */
+	unsigned int astralsz, astraln;
+} Fntmap;
+
 enum { ColFg, ColBg }; /* Clr scheme index */
 typedef XftColor Clr;
 
@@ -21,11 +32,22 @@ typedef struct {
 	int screen;
 	Window root;
 	Drawable drawable;
+	XftDraw *xftdraw;
+	struct Fntcache *fntcache; /* on-disk font matches, see drw_fontcache */
+	struct Shm *shm; /* client-side back buffer, see XSHM in config.mk */
 	GC gc;
 	Clr *scheme;
 	Fnt *fonts;
+	Fnt **fontv; /* fontset followed by the fallback fonts */
+	unsigned int fontn, fontsetn, fontsz;
+	Fntmap fntmap;
+	unsigned int ellipsisw, invalidw; /* widths in the fontset, 0 until measured */
+	XftGlyphFontSpec *specs;
+	unsigned int specsz;
 } Drw;
 
+extern unsigned long drw_xftcalls; /* calls into Xft so far */
+
 /* Drawable abstraction */
 Drw *drw_create(Display *dpy, int screen, Window win, unsigned int w, unsigned int h);
 void drw_resize(Drw *drw, unsigned int w, unsigned int h);
@@ -34,8 +56,13 @@ void drw_free(Drw *drw);
 /* Fnt abstraction */
 Fnt *drw_fontset_create(Drw* drw, const char *fonts[], size_t fontcount);
 void drw_fontset_free(Fnt* set);
+void drw_fontcache(Drw *drw, const char *path);
+void drw_fontcache_flush(Drw *drw);
+struct Fntstash *drw_fontset_stash(Drw *drw);
+void drw_fontset_restore(Drw *drw, struct Fntstash *s);
 unsigned int drw_fontset_getwidth(Drw *drw, const char *text);
 unsigned int drw_fontset_getwidth_clamp(Drw *drw, const char *text, unsigned int n);
+size_t drw_fontset_getprefixw(Drw *drw, const char *text, size_t from, size_t to, unsigned int *x);
 void drw_font_getexts(Fnt *font, const char *text, unsigned int len, unsigned int *w, unsigned int *h);
 
 int utf8len(const char *c);
@@ -55,6 +82,10 @@ void drw_setscheme(Drw *drw, Clr *scm);
 /* Drawing functions */
 void drw_rect(Drw *drw, int x, int y, unsigned int w, unsigned int h, int filled, int invert);
 int drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lpad, const char *text, int invert);
+int drw_text_hl(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lpad,
+                const char *text, const unsigned int *hl, unsigned int nhl, Clr *hlscm);
+
+void drw_copy(Drw *drw, int sx, int sy, unsigned int w, unsigned int h, int dx, int dy);
 
 /* Map functions */
 void drw_map(Drw *drw, Window win, int x, int y, unsigned int w, unsigned int h);
@@ -0,0 +1,261 @@
+/* See LICENSE file for copyright and license details. */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+
+#include "match.h"
+#include "util.h"
+
+struct item *items = NULL;
+struct item *matches, *matchend;
+char **tokv;
+int tokc;
+
+int (*fstrncmp)(const char *, const char *, size_t) = strncasecmp;
+char *(*fstrstr)(const char *, const char *) = cistrstr;
+unsigned int sortmatches = 1;
+
+/* Reads the lines of fp into items and returns their number. */
+size_t
+readitems(FILE *fp)
+{
+	char *line = NULL;
+	char *buf, *p;
+
+	size_t i, linesiz, itemsiz = 0;
+	ssize_t len;
+
+	/* read each line and add it to the item list */
+	for (i = 0; (len = getline(&line, &linesiz, fp)) != -1; i++) {
+		if (i + 1 >= itemsiz) {
+			itemsiz += 256;
+			if (!(items = realloc(items, itemsiz * sizeof(*items))))
+				die("cannot realloc %zu bytes:", itemsiz * sizeof(*items));
+		}
+		if (line[len - 1] == '\n')
+			line[len - 1] = '\0';
+
+		if (!(items[i].text = strdup(line)))
+			die("strdup:");
+		if (!(buf = strdup(line)))
+			die("cannot strdup %u bytes:", strlen(line) + 1);
+		if ((p = strchr(buf, '\t')))
+			*p = '\0';
+		items[i].stext = buf;
+		items[i].out = 0;
+		items[i].hlgen = 0;
+
+	}
+	free(line);
+	if (items)
+		items[i].text = NULL;
+	return i;
+}
+
+void
+freeitems(void)
+{
+	size_t i;
+
+	for (i = 0; items && items[i].text; i++) {
+		free(items[i].text);
+		free(items[i].stext);
+	}
+	free(items);
+	items = matches = matchend = NULL;
+}
+
+void
+appenditem(struct item *item, struct item **list, struct item **last)
+{
+	if (*last)
+		(*last)->right = item;
+	else
+		*list = item;
+
+	item->left = *last;
+	item->right = NULL;
+	*last = item;
+}
+
+char *
+cistrstr(const char *s, const char *sub)
+{
+	size_t len;
+
+	for (len = strlen(sub); *s; s++)
+		if (!strncasecmp(s, sub, len))
+			return (char *)s;
+	return NULL;
+}
+
+/* Matches the items against the space separated tokens of text, or with
+ * all takes every item. Returns whether no match is a substring match
+ * only, that is the first match is the best there is. */
+int
+matchtext(const char *text, int all)
+{
+	static char *buf;
+	static size_t bufsz;
+	static int tokn = 0;
+
+	char *s;
+	size_t len, textsize;
+	struct item *item, *lprefix, *lsubstr, *prefixend, *substrend;
+
+	textsize = strlen(text) + 1;
+	if (textsize > bufsz && !(buf = realloc(buf, (bufsz = textsize))))
+		die("cannot realloc %zu bytes:", bufsz);
+	memcpy(buf, text, textsize);
+	/* separate input text into tokens to be matched individually */
+	tokc = 0;
+	for (s = strtok(buf, " "); s; tokv[tokc - 1] = s, s = strtok(NULL, " "))
+		if (++tokc > tokn && !(tokv = realloc(tokv, ++tokn * sizeof *tokv)))
+			die("cannot realloc %zu bytes:", tokn * sizeof *tokv);
+	len = tokc ? strlen(tokv[0]) : 0;
+
+	matches = lprefix = lsubstr = matchend = prefixend = substrend = NULL;
+	for (item = items; item && item->text; item++)
+	{
+		if (!matchtokens(item->text, NULL) && !all) /* not all tokens match */
+			continue;
+		/* exact matches go first, then prefixes, then substrings */
+		if (!sortmatches)
+ 			appenditem(item, &matches, &matchend);
+ 		else
+		if (!tokc || !fstrncmp(text, item->text, textsize))
+			appenditem(item, &matches, &matchend);
+		else if (!fstrncmp(tokv[0], item->text, len))
+			appenditem(item, &lprefix, &prefixend);
+		else
+			appenditem(item, &lsubstr, &substrend);
+	}
+	if (lprefix) {
+		if (matches) {
+			matchend->right = lprefix;
+			lprefix->left = matchend;
+		} else
+			matches = lprefix;
+		matchend = prefixend;
+	}
+	if (lsubstr)
+	{
+		if (matches) {
+			matchend->right = lsubstr;
+			lsubstr->left = matchend;
+		} else
+			matches = lsubstr;
+		matchend = substrend;
+	}
+	return !lsubstr;
+}
+
+/* Returns whether s contains all tokens, passing where to span if set. */
+int
+matchtokens(const char *s, Spanfn span)
+{
+	char *p;
+	int i;
+
+	for (i = 0; i < tokc; i++) {
+		if (!(p = fstrstr(s, tokv[i])))
+			return 0;
+		if (span)
+			span(p - s, p - s + strlen(tokv[i]));
+	}
+	return 1;
+}
+
+static int
+compare_distance(const void *a, const void *b)
+{
+	struct item *da = *(struct item **) a;
+	struct item *db = *(struct item **) b;
+
+	if (!db)
+		return 1;
+	if (!da)
+		return -1;
+
+	return da->distance == db->distance ? 0 : da->distance < db->distance ? -1 : 1;
+}
+
+/* Walks s for the characters of text in order, passing each matched byte
+ * to span if set. sidx and eidx receive the offsets of the first and last
+ * matched character. */
+int
+fuzzyscan(const char *text, const char *s, int *sidx, int *eidx, Spanfn span)
+{
+	int i, pidx = 0, text_len = strlen(text); /* pointer */
+
+	*sidx = *eidx = -1; /* start of match, end of match */
+	/* walk through item text */
+	for (i = 0; s[i]; i++) {
+		/* fuzzy match pattern */
+		if (!fstrncmp(&text[pidx], &s[i], 1)) {
+			if (*sidx == -1)
+				*sidx = i;
+			if (span)
+				span(i, i + 1);
+			if (++pidx == text_len) {
+				*eidx = i;
+				break;
+			}
+		}
+	}
+	return *eidx != -1;
+}
+
+/* Matches the items that contain the characters of text in order, the
+ * closest first. */
+void
+fuzzytext(const char *text)
+{
+	/* bang - we have so much memory */
+	struct item *it;
+	struct item **fuzzymatches = NULL;
+	int number_of_matches = 0, i, sidx, eidx;
+	int text_len = strlen(text);
+	matches = matchend = NULL;
+
+	/* walk through all items */
+	for (it = items; it && it->text; it++) {
+		if (text_len) {
+			/* build list of matches */
+			if (fuzzyscan(text, it->text, &sidx, &eidx, NULL)) {
+				/* compute distance */
+				/* add penalty if match starts late (log(sidx+2))
+				 * add penalty for long a match without many matching characters */
+				it->distance = log(sidx + 2) + (double)(eidx - sidx - text_len);
+				/* fprintf(stderr, "distance %s %f\n", it->text, it->distance); */
+				appenditem(it, &matches, &matchend);
+				number_of_matches++;
+			}
+		} else {
+			appenditem(it, &matches, &matchend);
+		}
+	}
+
+	if (number_of_matches) {
+		/* initialize array with matches */
+		if (!(fuzzymatches = realloc(fuzzymatches, number_of_matches * sizeof(struct item*))))
+			die("cannot realloc %u bytes:", number_of_matches * sizeof(struct item*));
+		for (i = 0, it = matches; it && i < number_of_matches; i++, it = it->right) {
+			fuzzymatches[i] = it;
+		}
+
+		if (sortmatches)
+		/* sort matches according to distance */
+		qsort(fuzzymatches, number_of_matches, sizeof(struct item*), compare_distance);
+		/* rebuild list of matches */
+		matches = matchend = NULL;
+		for (i = 0, it = fuzzymatches[i];  i < number_of_matches && it && \
+				it->text; i++, it = fuzzymatches[i]) {
+			appenditem(it, &matches, &matchend);
+		}
+		free(fuzzymatches);
+	}
+}
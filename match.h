@@ -0,0 +1,36 @@
+/* See LICENSE file for copyright and license details. */
+
+struct item {
+	char *text;
+	char *stext;
+	struct item *left, *right;
+	int out;
+	double distance;
+	unsigned int hlgen, hlstart, hln; /* highlight spans, see pagehighlights() */
+};
+
+/* receives the byte range [start, end) of a match in an item */
+typedef void (*Spanfn)(unsigned int start, unsigned int end);
+
+/* item store, NULL text terminated, and the list of the last match */
+extern struct item *items;
+extern struct item *matches, *matchend;
+/* tokens of the last input matched by matchtext() */
+extern char **tokv;
+extern int tokc;
+
+extern int (*fstrncmp)(const char *, const char *, size_t);
+extern char *(*fstrstr)(const char *, const char *);
+extern unsigned int sortmatches;
+
+/* ingest */
+size_t readitems(FILE *fp);
+void freeitems(void);
+
+/* matching */
+void appenditem(struct item *item, struct item **list, struct item **last);
+char *cistrstr(const char *s, const char *sub);
+int matchtext(const char *text, int all);
+int matchtokens(const char *s, Spanfn span);
+void fuzzytext(const char *text);
+int fuzzyscan(const char *text, const char *s, int *sidx, int *eidx, Spanfn span);
@@ -0,0 +1,330 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * matchbench drives the item ingest and match engine of dmenu without an X
+ * server. It ingests generated and recorded corpora, types queries into
+ * them one keystroke at a time as dmenu would match them, and reports the
+ * latency of each keystroke, the throughput and the allocations made. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "arg.h"
+#include "match.h"
+#include "util.h"
+
+char *argv0;
+
+enum { ModeRegular, ModeCase, ModeFuzzy, ModeLast };
+
+static const char *modenames[] = {
+	[ModeRegular] = "regular",
+	[ModeCase]    = "-s",
+	[ModeFuzzy]   = "fuzzy",
+};
+
+static const char *words[] = {
+	"lib", "bin", "share", "local", "usr", "etc", "config", "x86_64",
+	"linux", "gnu", "python3", "perl", "ruby", "node", "modules", "src",
+	"include", "doc", "man", "icons", "hicolor", "apps", "dmenu", "stest",
+	"xdg", "open", "desktop", "terminal", "firefox", "chromium", "vim",
+	"emacs", "git", "make", "cmake", "gcc", "clang", "ld", "objdump",
+	"readelf", "systemd", "journal", "network", "manager", "pulse", "audio",
+	"video", "player", "screen", "shot", "font", "cache", "update",
+	"mime", "database", "kernel", "module", "firmware", "boot", "grub",
+	"ssh", "agent", "keygen", "server", "client",
+};
+
+static const char *uwords[] = {
+	"Café", "Müller", "naïve", "Ångström", "Straße", "façade", "Smörgåsbord",
+	"東京", "タワー", "音楽", "写真", "天気", "北京", "서울", "한국어",
+	"Москва", "Привет", "Ελλάδα", "αβγ", "שלום", "مرحبا", "हिन्दी",
+	"🎵", "📷", "🌦", "🚀", "❤️", "👍🏽",
+};
+
+static size_t nallocs;
+static unsigned long long rng = 88172645463325252ULL;
+
+#ifdef __GLIBC__
+/* count what the engine allocates, glibc lets the program replace these */
+void *__libc_malloc(size_t);
+void *__libc_calloc(size_t, size_t);
+void *__libc_realloc(void *, size_t);
+void __libc_free(void *);
+
+void *
+malloc(size_t n)
+{
+	nallocs++;
+	return __libc_malloc(n);
+}
+
+void *
+calloc(size_t n, size_t m)
+{
+	nallocs++;
+	return __libc_calloc(n, m);
+}
+
+void *
+realloc(void *p, size_t n)
+{
+	nallocs++;
+	return __libc_realloc(p, n);
+}
+
+void
+free(void *p)
+{
+	__libc_free(p);
+}
+#endif
+
+static unsigned long long
+rnd(void)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return rng;
+}
+
+#define PICK(a) ((a)[rnd() % LENGTH(a)])
+
+static long long
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void
+genpath(FILE *fp)
+{
+	int i, n = 2 + rnd() % 5;
+
+	for (i = 0; i < n; i++)
+		fprintf(fp, "/%s", PICK(words));
+	if (rnd() % 2)
+		fprintf(fp, "%s.%s", rnd() % 2 ? "-" : "_", PICK(words));
+	fputc('\n', fp);
+}
+
+static void
+gencommand(FILE *fp)
+{
+	int i, n = 1 + rnd() % 3;
+
+	for (i = 0; i < n; i++)
+		fprintf(fp, "%s%s", i ? (rnd() % 2 ? "-" : "_") : "", PICK(words));
+	if (!(rnd() % 4))
+		fprintf(fp, "%d", (int)(rnd() % 12));
+	fputc('\n', fp);
+}
+
+static void
+genunicode(FILE *fp)
+{
+	int i, n = 1 + rnd() % 4;
+
+	for (i = 0; i < n; i++)
+		fprintf(fp, "%s%s", i ? " " : "", rnd() % 3 ? PICK(uwords) : PICK(words));
+	fputc('\n', fp);
+}
+
+/* picks a query of up to 6 characters out of a random item */
+static char *
+pickquery(size_t nitems)
+{
+	static char q[64];
+	const char *s = items[rnd() % nitems].text;
+	size_t len = strlen(s), start, end;
+	int chars;
+
+	start = len ? rnd() % len : 0;
+	while (start && (s[start] & 0xc0) == 0x80)
+		start--;
+	for (end = start, chars = 0; s[end] && chars < 6 && end - start < sizeof(q) - 8; chars++)
+		for (end++; (s[end] & 0xc0) == 0x80; end++)
+			;
+	memcpy(q, s + start, end - start);
+	q[end - start] = '\0';
+	return q;
+}
+
+static int
+llcmp(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+setmode(int mode)
+{
+	fstrncmp = mode == ModeCase ? strncmp : strncasecmp;
+	fstrstr = mode == ModeCase ? strstr : cistrstr;
+}
+
+/* types each query character by character and erases it again */
+static void
+typequeries(size_t nitems, int mode, int nqueries)
+{
+	char queries[64][64], input[64];
+	long long *lat, t, total = 0;
+	size_t b[64], nkeys = 0, allocs;
+	int q, c, nc, i;
+
+	for (q = 0; q < nqueries; q++)
+		strcpy(queries[q], pickquery(nitems));
+	if (!(lat = malloc(nqueries * 2 * 64 * sizeof(*lat))))
+		die("malloc:");
+	setmode(mode);
+	allocs = nallocs;
+	for (q = 0; q < nqueries; q++) {
+		/* byte offsets of the character boundaries */
+		for (b[0] = 0, nc = 0; queries[q][b[nc]]; nc++)
+			for (b[nc + 1] = b[nc] + 1; (queries[q][b[nc + 1]] & 0xc0) == 0x80; b[nc + 1]++)
+				;
+		/* one keystroke per character typed, then per one erased */
+		for (i = 1; i <= 2 * nc; i++) {
+			c = i <= nc ? i : 2 * nc - i;
+			memcpy(input, queries[q], b[c]);
+			input[b[c]] = '\0';
+			t = now();
+			if (mode == ModeFuzzy)
+				fuzzytext(input);
+			else
+				matchtext(input, 0);
+			lat[nkeys] = now() - t;
+			total += lat[nkeys++];
+		}
+	}
+	allocs = nallocs - allocs;
+	if (!nkeys) {
+		free(lat);
+		return;
+	}
+	qsort(lat, nkeys, sizeof(*lat), llcmp);
+	printf("  %-8s %6zu %9.1f %9.1f %9.1f %9.1f %9.1f %10.2f\n",
+	       modenames[mode], nkeys,
+	       lat[nkeys / 2] / 1e3, lat[nkeys * 9 / 10] / 1e3,
+	       lat[nkeys * 99 / 100] / 1e3, lat[nkeys - 1] / 1e3,
+	       total ? nitems * (double)nkeys / (total / 1e9) / 1e6 : 0,
+	       (double)allocs / nkeys);
+	free(lat);
+}
+
+static void
+bench(const char *name, char *buf, size_t len, int nqueries)
+{
+	FILE *fp;
+	long long t;
+	size_t nitems, allocs;
+	int mode;
+
+	if (!(fp = fmemopen(buf, len, "r")))
+		die("fmemopen:");
+	allocs = nallocs;
+	t = now();
+	nitems = readitems(fp);
+	t = now() - t;
+	allocs = nallocs - allocs;
+	fclose(fp);
+
+	printf("%s: %zu items, %.1f MB, ingest %.1f ms (%.0f MB/s), %.2f allocs/item\n",
+	       name, nitems, len / 1e6, t / 1e6, t ? len / (t / 1e9) / 1e6 : 0,
+	       nitems ? (double)allocs / nitems : 0);
+	if (nitems) {
+		printf("  %-8s %6s %9s %9s %9s %9s %9s %10s\n", "mode", "keys",
+		       "p50 us", "p90 us", "p99 us", "max us", "Mitems/s", "allocs/key");
+		for (mode = 0; mode < ModeLast; mode++)
+			typequeries(nitems, mode, nqueries);
+	}
+	freeitems();
+}
+
+static void
+generated(const char *kind, void (*gen)(FILE *), size_t n, int nqueries)
+{
+	FILE *fp;
+	char *buf = NULL, name[64];
+	size_t len, i;
+
+	if (!(fp = open_memstream(&buf, &len)))
+		die("open_memstream:");
+	for (i = 0; i < n; i++)
+		gen(fp);
+	fclose(fp);
+	snprintf(name, sizeof(name), "%s %zu", kind, n);
+	bench(name, buf, len, nqueries);
+	free(buf);
+}
+
+static void
+recorded(const char *path, int nqueries)
+{
+	FILE *fp;
+	char *buf = NULL;
+	size_t len = 0, size = 0, r;
+
+	if (!(fp = fopen(path, "r")))
+		die("%s:", path);
+	do {
+		if (len == size && !(buf = realloc(buf, size = size ? 2 * size : 1 << 20)))
+			die("realloc:");
+		len += (r = fread(buf + len, 1, size - len, fp));
+	} while (r);
+	fclose(fp);
+	bench(path, buf, len, nqueries);
+	free(buf);
+}
+
+static void
+usage(void)
+{
+	die("usage: %s [-n sizes] [-q queries] [-f corpus]...", argv0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char *sizes = "1000,10000,100000,1000000", *s, *f[16];
+	size_t n;
+	int i, nf = 0, nqueries = 8;
+
+	ARGBEGIN {
+	case 'f': /* recorded corpus, one item per line */
+		if (nf == LENGTH(f))
+			usage();
+		f[nf++] = EARGF(usage());
+		break;
+	case 'n': /* comma separated sizes of the generated corpora */
+		sizes = EARGF(usage());
+		break;
+	case 'q': /* queries typed per corpus and mode */
+		if ((nqueries = atoi(EARGF(usage()))) < 1 || nqueries > 64)
+			usage();
+		break;
+	default:
+		usage();
+	} ARGEND;
+	if (argc)
+		usage();
+
+	for (s = sizes; *s; s += strspn(s, ",")) {
+		n = strtoul(s, &s, 10);
+		if (!n)
+			usage();
+		generated("paths", genpath, n, nqueries);
+		generated("commands", gencommand, n, nqueries);
+		generated("unicode", genunicode, n, nqueries);
+	}
+	for (i = 0; i < nf; i++)
+		recorded(f[i], nqueries);
+	return 0;
+}
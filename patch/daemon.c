@@ -0,0 +1,271 @@
+/* The daemon keeps the connection, fonts, glyph caches and window of one
+ * dmenu and serves menus for dmenuc one at a time. A request is a 32-bit
+ * length with the client's fds 0, 1 and 2 attached, followed by that many
+ * bytes of NUL-terminated arguments. The reply is the exit status in one
+ * byte, or 255 to have the client run dmenu itself. */
+#define DAEMONARGMAX (1 << 20)
+
+static jmp_buf daemonjmp;
+static int daemonfd = -1, nullfd, errfd;
+static struct Fntstash *daemonfonts; /* set aside for a request's -fn */
+static Clr *daemonscheme[SchemeLast]; /* schemes of the default colors */
+
+/* option state every request starts from: the daemon's own command line */
+static struct {
+	int topbar, center, fast, incremental, instant, fuzzy, passwd;
+	int reject_no_match, restrict_return, mon;
+	unsigned int lines, lineheight, sortmatches, preselected, border_width;
+	unsigned int vi_mode, using_vi_mode;
+	int pathsrc;
+	Key global_esc;
+	const char *prompt, *dynamic;
+	char *font, *colors[SchemeLast][2];
+	int (*fstrncmp)(const char *, const char *, size_t);
+	char *(*fstrstr)(const char *, const char *);
+} defaults;
+
+static void
+daemonopts(int save)
+{
+#define OPT(v) do { if (save) defaults.v = v; else v = defaults.v; } while (0)
+	OPT(topbar); OPT(center); OPT(fast); OPT(incremental); OPT(instant);
+	OPT(fuzzy); OPT(passwd); OPT(reject_no_match); OPT(restrict_return);
+	OPT(mon); OPT(lines); OPT(lineheight); OPT(sortmatches);
+	OPT(preselected); OPT(border_width); OPT(vi_mode); OPT(using_vi_mode);
+	OPT(pathsrc);
+	OPT(global_esc); OPT(prompt); OPT(dynamic); OPT(fstrncmp); OPT(fstrstr);
+#undef OPT
+	if (save) {
+		defaults.font = fonts[0];
+		memcpy(defaults.colors, colors, sizeof(defaults.colors));
+	} else {
+		fonts[0] = defaults.font;
+		memcpy(colors, defaults.colors, sizeof(colors));
+	}
+}
+
+static void
+daemonwake(int sig)
+{
+	/* only interrupts the reader's read(), see daemonreset() */
+}
+
+static void
+daemonreturn(int status)
+{
+	longjmp(daemonjmp, status + 1);
+}
+
+static int
+daemonrecv(int fd, int fds[3], char **buf, uint32_t *len)
+{
+	char cbuf[CMSG_SPACE(3 * sizeof(int))];
+	struct iovec iov = { len, sizeof(*len) };
+	struct msghdr msg = { 0 };
+	struct cmsghdr *cm;
+	size_t off;
+	ssize_t r;
+	int i;
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	if (recvmsg(fd, &msg, 0) != sizeof(*len))
+		return -1;
+	if (!(cm = CMSG_FIRSTHDR(&msg)) || cm->cmsg_level != SOL_SOCKET ||
+	    cm->cmsg_type != SCM_RIGHTS)
+		return -1;
+	if (cm->cmsg_len != CMSG_LEN(3 * sizeof(int))) {
+		for (i = 0; i < (int)((cm->cmsg_len - CMSG_LEN(0)) / sizeof(int)); i++)
+			close(((int *)CMSG_DATA(cm))[i]);
+		return -1;
+	}
+	memcpy(fds, CMSG_DATA(cm), 3 * sizeof(int));
+	if (*len > DAEMONARGMAX)
+		goto fail;
+	*buf = ecalloc(1, *len + 1);
+	for (off = 0; off < *len; off += r)
+		if ((r = read(fd, *buf + off, *len - off)) <= 0) {
+			free(*buf);
+			goto fail;
+		}
+	return 0;
+fail:
+	for (i = 0; i < 3; i++)
+		close(fds[i]);
+	return -1;
+}
+
+static int
+daemonserve(int argc, char *argv[])
+{
+	int i;
+
+	/* embedding needs a window of the client's choice */
+	for (i = 1; i < argc; i++)
+		if (!strcmp(argv[i], "-w"))
+			return 255;
+	if ((i = setjmp(daemonjmp)))
+		return i - 1;
+	serving = 1;
+	parseargs(argc, argv);
+
+	/* the daemon's fonts keep what they learned while a request uses
+	 * others */
+	if (strcmp(fonts[0], defaults.font)) {
+		daemonfonts = drw_fontset_stash(drw);
+		if (!drw_fontset_create(drw, (const char **)fonts, LENGTH(fonts))) {
+			fprintf(stderr, "dmenu: cannot load font %s\n", fonts[0]);
+			drw_fontset_restore(drw, daemonfonts);
+			daemonfonts = NULL;
+		}
+	}
+	lrpad = drw->fonts->h;
+	if (lineheight == -1)
+		lineheight = drw->fonts->h * 2.5;
+	for (i = 0; i < SchemeLast; i++)
+		if (memcmp(colors[i], defaults.colors[i], sizeof(colors[i])))
+			scheme[i] = drw_scm_create(drw, (const char**)colors[i], 2);
+
+	if (!(dynamic && *dynamic))
+		readstart();
+	if (fast && !isatty(0)) {
+		grabkeyboard();
+		readwait();
+	} else {
+		readwait();
+		grabkeyboard();
+	}
+	setup();
+	run();
+	return 1; /* unreachable */
+}
+
+/* Hides the menu and puts back the state the next request starts from. */
+static void
+daemonreset(void)
+{
+	size_t i;
+
+	serving = 0;
+	/* a request that ended early leaves the reader blocked on the
+	 * client's stdin: give it /dev/null and interrupt the read */
+	if (reading) {
+		dup2(nullfd, 0);
+		pthread_kill(reader, SIGUSR1);
+	}
+	readwait();
+	fflush(stdout);
+	clearerr(stdout);
+	XUngrabKeyboard(dpy, CurrentTime);
+	XSelectInput(dpy, root, NoEventMask); /* a grab given up on */
+	if (win)
+		XUnmapWindow(dpy, win);
+	XSync(dpy, True); /* drop what is left of the last menu's events */
+
+	if (daemonfonts) {
+		drw_fontset_restore(drw, daemonfonts);
+		daemonfonts = NULL;
+	}
+	drw_fontcache_flush(drw);
+
+	for (i = 0; i < SchemeLast; i++) {
+		if (scheme[i] != daemonscheme[i])
+			free(scheme[i]);
+		scheme[i] = daemonscheme[i];
+	}
+	freeitems();
+	prev = curr = next = sel = NULL;
+	text[0] = '\0';
+	cursor = 0;
+	textchanged(0);
+	fulldraw = 1;
+	drawncurr = drawnsel = NULL;
+	ndrawn = 0;
+	pendingmatch = pendingdraw = 0;
+	daemonopts(0);
+
+	dup2(nullfd, 0);
+	dup2(nullfd, 1);
+	dup2(errfd, 2);
+}
+
+static void
+daemonrun(void)
+{
+	struct sockaddr_un sa = { .sun_family = AF_UNIX };
+	struct sigaction sig = { .sa_handler = SIG_IGN };
+	struct sigaction wake = { .sa_handler = daemonwake };
+	char **argv, *buf, *p;
+	unsigned char status;
+	uint32_t len;
+	mode_t mask;
+	int argc, fd, fds[3], i;
+
+	if (embed)
+		die("dmenu: -daemon cannot be combined with -w");
+	if (daemonpath(sa.sun_path, sizeof(sa.sun_path)) < 0)
+		die("dmenu: daemon socket path too long");
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		die("socket:");
+	if (!connect(fd, (struct sockaddr *)&sa, sizeof(sa)))
+		die("dmenu: a daemon is already listening on %s", sa.sun_path);
+	close(fd);
+	unlink(sa.sun_path);
+	if ((daemonfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		die("socket:");
+	mask = umask(077);
+	if (bind(daemonfd, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+		die("bind %s:", sa.sun_path);
+	umask(mask);
+	if (listen(daemonfd, SOMAXCONN) < 0)
+		die("listen:");
+	fcntl(daemonfd, F_SETFD, FD_CLOEXEC);
+
+	sigaction(SIGPIPE, &sig, NULL);
+	sigaction(SIGUSR1, &wake, NULL); /* no SA_RESTART */
+	if ((nullfd = open("/dev/null", O_RDWR)) < 0)
+		die("open /dev/null:");
+	if ((errfd = dup(2)) < 0)
+		die("dup:");
+	fcntl(nullfd, F_SETFD, FD_CLOEXEC);
+	fcntl(errfd, F_SETFD, FD_CLOEXEC);
+	dup2(nullfd, 0);
+	dup2(nullfd, 1);
+	daemonopts(1);
+	memcpy(daemonscheme, scheme, sizeof(daemonscheme));
+
+	/* clients queue up in the listen backlog and are served in turn */
+	for (;;) {
+		if ((fd = accept(daemonfd, NULL, NULL)) < 0)
+			continue;
+		if (!samepeer(fd)) {
+			close(fd);
+			continue;
+		}
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		if (daemonrecv(fd, fds, &buf, &len) < 0) {
+			close(fd);
+			continue;
+		}
+		for (argc = 1, p = buf; p < buf + len; p += strlen(p) + 1)
+			argc++;
+		argv = ecalloc(argc + 1, sizeof(*argv));
+		argv[0] = "dmenu";
+		for (i = 1, p = buf; p < buf + len; p += strlen(p) + 1)
+			argv[i++] = p;
+
+		for (i = 0; i < 3; i++) {
+			dup2(fds[i], i);
+			close(fds[i]);
+		}
+		clearerr(stdin);
+		status = daemonserve(argc, argv);
+		daemonreset();
+		write(fd, &status, 1);
+		close(fd);
+		free(argv);
+		free(buf);
+	}
+}
@@ -0,0 +1,5 @@
+static int daemonmode; /* -daemon: serve menus for dmenuc, see daemonrun() */
+static int serving;    /* a request is being served, quit() returns to it */
+
+static void daemonrun(void);
+static void daemonreturn(int status);
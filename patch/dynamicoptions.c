@@ -38,6 +38,7 @@ readstream(FILE* stream)
 		if (!(items[i].stext = strdup(buf)))
 			die("cannot strdup %u bytes:", strlen(buf) + 1);
 		items[i].out = 0;
+		items[i].hlgen = 0;
 		drw_font_getexts(drw->fonts, buf, strlen(buf), &tmpmax, NULL);
 		if (tmpmax > inputw) {
 			inputw = tmpmax;
@@ -56,6 +57,7 @@ readstream(FILE* stream)
 		lines = MIN(lines, i);
 	else {
 		text[0] = '\0';
+		textchanged(0);
 		cursor = 0;
 	}
 }
@@ -0,0 +1 @@
+static void fuzzymatch(void);
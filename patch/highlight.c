@@ -1,78 +1,93 @@
-static void
-drawhighlights(struct item *item, int x, int y, int maxw)
-{
-	char restorechar, tokens[sizeof text], *highlight,  *token;
-	int indent, highlightlen;
-
-	int i;
+/* byte ranges of the matches in the items highlighted since the last
+ * match(), an item's spans are current while its hlgen equals hlgen */
+static unsigned int *hlspans;
+static unsigned int hlspansz, hlspann;
+static unsigned int hlgen = 1, hlspansgen;
+static struct item *hlitem; /* item addspan() records for */
 
-	char *itemtext = item->stext;
+static int
+spancmp(const void *a, const void *b)
+{
+	unsigned int sa = *(const unsigned int *)a, sb = *(const unsigned int *)b;
 
-	if (!(strlen(itemtext) && strlen(text)))
-		return;
+	return sa < sb ? -1 : sa > sb;
+}
 
-	/* Do not highlight items scheduled for output */
-	if (item->out)
+/* called by the matchers for the item pagehighlights() is recording */
+static void
+addspan(unsigned int start, unsigned int end)
+{
+	/* extend the previous span of the same item if this one continues it */
+	if (hlspann > 2 * hlitem->hlstart && hlspans[hlspann - 1] == start) {
+		hlspans[hlspann - 1] = end;
 		return;
+	}
+	if (hlspann + 2 > hlspansz &&
+	    !(hlspans = realloc(hlspans, (hlspansz += 64) * sizeof *hlspans)))
+		die("cannot realloc %zu bytes:", hlspansz * sizeof *hlspans);
+	hlspans[hlspann++] = start;
+	hlspans[hlspann++] = end;
+}
 
-	drw_setscheme(drw, scheme[item == sel ? SchemeSelHighlight : SchemeNormHighlight]);
+/* Lets the matcher record where it matched the items of the page that
+ * have no spans since the last match(), as they scroll into view. */
+static void
+pagehighlights(void)
+{
+	struct item *item;
+	unsigned int *sp, i, j, n;
+	int sidx, eidx, len = strlen(text);
 
-	if (fuzzy) {
-		for (i = 0, highlight = itemtext; *highlight && text[i];) {
-			highlightlen = utf8len(highlight);
-			if (!fstrncmp(&(*highlight), &text[i], highlightlen))
-			{
-				/* get indentation */
-				restorechar = *highlight;
-				*highlight = '\0';
-				indent = TEXTW(itemtext) - lrpad;
-				*highlight = restorechar;
+	if (hlspansgen != hlgen) {
+		hlspann = 0;
+		hlspansgen = hlgen;
+	}
+	for (item = curr; len && item && item != next; item = item->right) {
+		if (item->hlgen == hlgen)
+			continue;
+		hlitem = item;
+		item->hlgen = hlgen;
+		item->hlstart = hlspann / 2;
+		if (fuzzy)
+			fuzzyscan(text, item->text, &sidx, &eidx, addspan);
+		else
+			matchtokens(item->text, addspan);
 
-				/* highlight character */
-				restorechar = highlight[highlightlen];
-				highlight[highlightlen] = '\0';
-				drw_text(
-					drw,
-					x + indent + (lrpad / 2),
-					y,
-					MIN(maxw - indent - lrpad, TEXTW(highlight) - lrpad),
-					bh, 0, highlight, 0
-				);
-				highlight[highlightlen] = restorechar;
-				i += highlightlen;
+		/* occurrences of different tokens may be out of order or overlap */
+		sp = &hlspans[2 * item->hlstart];
+		n = hlspann / 2 - item->hlstart;
+		qsort(sp, n, 2 * sizeof *sp, spancmp);
+		for (i = j = 0; i < n; i++) {
+			if (j && sp[2 * i] <= sp[2 * j - 1]) {
+				sp[2 * j - 1] = MAX(sp[2 * j - 1], sp[2 * i + 1]);
+			} else {
+				sp[2 * j] = sp[2 * i];
+				sp[2 * j + 1] = sp[2 * i + 1];
+				j++;
 			}
-			highlight++;
 		}
-		return;
+		hlspann = 2 * (item->hlstart + j);
+		item->hln = j;
 	}
+}
 
-	strcpy(tokens, text);
-	for (token = strtok(tokens, " "); token; token = strtok(NULL, " ")) {
-		highlight = fstrstr(itemtext, token);
-		while (highlight) {
-			// Move item str end, calc width for highlight indent, & restore
-			highlightlen = highlight - itemtext;
-			restorechar = *highlight;
-			itemtext[highlightlen] = '\0';
-			indent = TEXTW(itemtext);
-			itemtext[highlightlen] = restorechar;
+/* Returns the spans pagehighlights() recorded within the item's display
+ * text, in the form drw_text_hl() expects them. */
+static unsigned int
+highlightspans(struct item *item, const unsigned int **spans)
+{
+	unsigned int n, len;
 
-			// Move highlight str end, draw highlight, & restore
-			restorechar = highlight[strlen(token)];
-			highlight[strlen(token)] = '\0';
-			if (indent - (lrpad / 2) - 1 < maxw)
-				drw_text(
-					drw,
-					x + indent - (lrpad / 2) - 1,
-					y,
-					MIN(maxw - indent, TEXTW(highlight) - lrpad),
-					bh, 0, highlight, 0
-				);
-			highlight[strlen(token)] = restorechar;
+	*spans = NULL;
+	/* Do not highlight items scheduled for output */
+	if (item->out)
+		return 0;
 
-			if (strlen(highlight) - strlen(token) < strlen(token))
-				break;
-			highlight = fstrstr(highlight + strlen(token), token);
-		}
-	}
+	if (item->hlgen != hlgen || !*text)
+		return 0;
+	*spans = &hlspans[2 * item->hlstart];
+	len = strlen(item->stext);
+	for (n = 0; n < item->hln && (*spans)[2 * n] < len; n++)
+		; /* NOP */
+	return n;
 }
@@ -0,0 +1,3 @@
+static void addspan(unsigned int start, unsigned int end);
+static void pagehighlights(void);
+static unsigned int highlightspans(struct item *item, const unsigned int **spans);
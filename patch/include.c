@@ -5,3 +5,6 @@
 #include "vi_mode.c"
 #include "numbers.c"
 #include "xresources.c"
+#include "trace.c"
+#include "daemon.c"
+#include "path.c"
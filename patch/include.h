@@ -1,3 +1,8 @@
 #include "dynamicoptions.h"
+#include "fuzzymatch.h"
+#include "highlight.h"
 #include "vi_mode.h"
 #include "numbers.h"
+#include "trace.h"
+#include "daemon.h"
+#include "path.h"
@@ -0,0 +1,174 @@
+/* The items of -path are the executables in $PATH, sorted and without
+ * duplicates, as dmenu_path would list them. Each directory is read once
+ * and its entries are looked up relative to it, skipping what the d_type
+ * already rules out. A list kept by a running stest -I watcher is used
+ * instead when there is one, otherwise the cache of dmenu_path. */
+static int
+pathexec(int dirfd, const char *name)
+{
+	struct stat st;
+
+	/* as stest -fx decides it, see permitted() in util.c */
+	return !fstatat(dirfd, name, &st, 0) && S_ISREG(st.st_mode) &&
+	       permitted(dirfd, name, &st, X_OK);
+}
+
+static int
+pathcmp(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* writes the path of the dmenu_run cache dmenu_path keeps, with suffix
+ * appended, to buf; returns 0 if there is no place for it */
+static int
+pathcache(char *buf, size_t n, const char *suffix)
+{
+	char *dir;
+	int r;
+
+	if ((dir = getenv("XDG_CACHE_HOME")) && *dir)
+		r = snprintf(buf, n, "%s/dmenu_run%s", dir, suffix);
+	else if ((dir = getenv("HOME")))
+		r = snprintf(buf, n, "%s/.cache/dmenu_run%s", dir, suffix);
+	else
+		return 0;
+	return r >= 0 && (size_t)r < n;
+}
+
+/* reads the list of a running stest -I watcher; returns 0 if there is none */
+static int
+readpathlist(void)
+{
+	char path[4096];
+	FILE *fp;
+	long pid;
+
+	if (!pathcache(path, sizeof(path), ".list.pid"))
+		return 0;
+	if (!(fp = fopen(path, "r")))
+		return 0;
+	if (fscanf(fp, "%ld", &pid) != 1 || pid <= 0 || kill((pid_t)pid, 0)) {
+		fclose(fp);
+		return 0;
+	}
+	fclose(fp);
+	path[strlen(path) - strlen(".pid")] = '\0';
+	if (!(fp = fopen(path, "r")))
+		return 0;
+	readfile(fp);
+	fclose(fp);
+	return 1;
+}
+
+/* lists the executables in the directory of e, as stest -flx does */
+static void
+pathscan(struct cacheent *e)
+{
+	struct dirent *d;
+	DIR *dir;
+	FILE *fp;
+
+	if (!(fp = open_memstream(&e->buf, &e->len)))
+		die("open_memstream:");
+	if ((dir = opendir(e->arg))) {
+		while ((d = readdir(dir))) {
+			if (d->d_name[0] == '.' || d->d_type == DT_DIR ||
+			    (d->d_type != DT_UNKNOWN && d->d_type != DT_REG &&
+			     d->d_type != DT_LNK))
+				continue;
+			if (pathexec(dirfd(dir), d->d_name))
+				fprintf(fp, "%s\n", d->d_name);
+		}
+		closedir(dir);
+	} else if (pathexec(AT_FDCWD, e->arg)) {
+		/* stest tests an argument that is not a directory itself */
+		fprintf(fp, "%s\n", e->arg);
+	}
+	if (fclose(fp))
+		die("fclose:");
+}
+
+/* Directories that did not change since dmenu_path last listed them are
+ * taken from its stest -C cache, the others are scanned and the cache
+ * is written back. */
+static void
+readpath(void)
+{
+	struct cacheent *ents = NULL;
+	char cache[4096], *paths, *data = NULL, *p, *q, *end, **names = NULL;
+	size_t i, n = 0, nents = 0, size = 0, len;
+	int *scanned, stale = 0;
+
+	if (readpathlist())
+		return;
+	if (permitinit() < 0)
+		die("getgroups:");
+	/* no PATH lists nothing, as with dmenu_path */
+	if (!(p = getenv("PATH")))
+		p = "";
+	if (!(paths = strdup(p)))
+		die("strdup:");
+	/* split as the IFS=: of dmenu_path does, so both keep the same cache;
+	 * an empty directory lists nothing, as with stest */
+	for (p = paths; p; p = q) {
+		if ((q = strchr(p, ':')))
+			*q++ = '\0';
+		else if (!*p)
+			break; /* a trailing empty field */
+		if (!(ents = realloc(ents, (nents + 1) * sizeof(*ents))))
+			die("cannot realloc %zu bytes:", (nents + 1) * sizeof(*ents));
+		ents[nents].arg = p;
+		cachestat(&ents[nents++]);
+	}
+	if (!pathcache(cache, sizeof(cache), ""))
+		cache[0] = '\0';
+	else
+		data = cacheload(cache, "flx", ents, nents);
+	scanned = ecalloc(nents + 1, sizeof(*scanned));
+	for (i = 0; i < nents; i++) {
+		if (ents[i].buf)
+			continue;
+		pathscan(&ents[i]);
+		scanned[i] = stale = 1;
+	}
+	if (stale && cache[0])
+		cachesave(cache, "flx", ents, nents);
+
+	for (i = 0; i < nents; i++) {
+		end = ents[i].buf + ents[i].len;
+		for (p = ents[i].buf; p < end && (q = memchr(p, '\n', end - p)); p = q + 1) {
+			if (n == size) {
+				size = size ? size * 2 : 1024;
+				if (!(names = realloc(names, size * sizeof(*names))))
+					die("cannot realloc %zu bytes:", size * sizeof(*names));
+			}
+			if (!(names[n++] = strndup(p, q - p)))
+				die("strndup:");
+		}
+		if (scanned[i])
+			free(ents[i].buf);
+	}
+	free(scanned);
+	free(data);
+	free(ents);
+	free(paths);
+
+	if (n)
+		qsort(names, n, sizeof(*names), pathcmp);
+	items = ecalloc(n + 1, sizeof(*items));
+	for (i = len = 0; i < n; i++) {
+		if (len && !strcmp(names[i], items[len - 1].text)) {
+			free(names[i]);
+			continue;
+		}
+		items[len].text = names[i];
+		if (!(items[len].stext = strdup(names[i])))
+			die("strdup:");
+		items[len].hlgen = 0;
+		items[len++].out = 0;
+	}
+	items[len].text = NULL;
+	free(names);
+	lines = MIN(lines, len);
+}
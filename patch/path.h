@@ -0,0 +1,3 @@
+static int pathsrc; /* -path: list the programs in $PATH instead of reading stdin */
+
+static void readpath(void);
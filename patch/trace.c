@@ -0,0 +1,178 @@
+/* startup phase timing, enabled with DMENU_TRACE set to a file or "-" */
+#define TRACEBENCHROUNDS 10
+static FILE *tracefp;
+static long long tracestart;
+static struct {
+	const char *name;
+	long long begin, end;
+} tracephases[TraceLast] = {
+	[TraceOpen]       = { "open" },
+	[TraceXresources] = { "xresources" },
+	[TraceFonts]      = { "fonts" },
+	[TraceStdin]      = { "stdin" },
+	[TraceStdinWait]  = { "stdinwait" },
+	[TraceGrab]       = { "grab" },
+	[TraceFocus]      = { "focus" },
+	[TraceGeometry]   = { "geometry" },
+	[TraceXinerama]   = { "xinerama" },
+	[TraceIM]         = { "im" },
+	[TraceDraw]       = { "draw" },
+};
+static struct {
+	long long begin, *time;
+	unsigned long reqbegin, xftbegin, requests, xftcalls;
+	size_t n, size;
+} traceframes;
+
+static long long
+tracenow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void
+tracebegin(int phase)
+{
+	static int init;
+	const char *path;
+
+	if (!init) {
+		init = 1;
+		if ((path = getenv("DMENU_TRACE")) && *path) {
+			tracefp = strcmp(path, "-") ? fopen(path, "a") : stderr;
+			tracestart = tracenow();
+		}
+	}
+	if (tracefp)
+		tracephases[phase].begin = tracenow();
+}
+
+static void
+traceend(int phase)
+{
+	if (tracefp && tracephases[phase].begin)
+		tracephases[phase].end = tracenow();
+}
+
+/* Marks the begin and end of a frame, the match and draw after a batch of
+ * events. A frame ends once the server has processed its requests. */
+static void
+traceframe(int end)
+{
+	if (!tracefp)
+		return;
+	if (!end) {
+		traceframes.begin = tracenow();
+		traceframes.reqbegin = NextRequest(dpy);
+		traceframes.xftbegin = drw_xftcalls;
+		return;
+	}
+	traceframes.requests += NextRequest(dpy) - traceframes.reqbegin;
+	traceframes.xftcalls += drw_xftcalls - traceframes.xftbegin;
+	XSync(dpy, False);
+	if (traceframes.n == traceframes.size) {
+		traceframes.size = traceframes.size ? 2 * traceframes.size : 256;
+		if (!(traceframes.time = realloc(traceframes.time,
+		      traceframes.size * sizeof(*traceframes.time))))
+			die("cannot realloc %zu bytes:", traceframes.size * sizeof(*traceframes.time));
+	}
+	traceframes.time[traceframes.n++] = tracenow() - traceframes.begin;
+}
+
+/* Types DMENU_BENCH into the input and erases it again, TRACEBENCHROUNDS
+ * times with one frame per keystroke, then quits with status 0. */
+static void
+tracebench(void)
+{
+	const char *s = getenv("DMENU_BENCH");
+	size_t i, n;
+	int round;
+
+	if (!tracefp || !s || !*s)
+		return;
+	for (round = 0; round < TRACEBENCHROUNDS; round++) {
+		for (i = 0; s[i]; i += n) {
+			for (n = 1; (s[i + n] & 0xc0) == 0x80; n++)
+				;
+			insert(&s[i], n);
+			traceframe(0);
+			if (pendingmatch)
+				match();
+			drawmenu();
+			traceframe(1);
+		}
+		while (cursor) {
+			insert(NULL, nextrune(-1) - cursor);
+			traceframe(0);
+			if (pendingmatch)
+				match();
+			drawmenu();
+			traceframe(1);
+		}
+	}
+	quit(0);
+}
+
+static int
+tracecmp(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Writes one line of key=value pairs, durations in microseconds. expose
+ * is the time from the start of main() to the first Expose, missing if dmenu quit
+ * before it. */
+static void
+tracedump(int expose)
+{
+	static int dumped;
+	int i, n;
+
+	if (!tracefp || dumped)
+		return;
+	dumped = 1;
+	for (n = 0; items && items[n].text; n++)
+		; /* NOP */
+	fprintf(tracefp, "dmenu pid=%ld items=%d", (long)getpid(), n);
+	for (i = 0; i < TraceLast; i++)
+		if (tracephases[i].end)
+			fprintf(tracefp, " %s=%lld", tracephases[i].name,
+			        tracephases[i].end - tracephases[i].begin);
+	if (expose)
+		fprintf(tracefp, " expose=%lld", tracenow() - tracestart);
+	fputc('\n', tracefp);
+	fflush(tracefp);
+}
+
+/* Writes the startup line if still due and a line of frame statistics: the
+ * percentiles of the frame time in microseconds and the mean X requests and
+ * Xft calls per frame. */
+static void
+traceexit(void)
+{
+	size_t n = traceframes.n;
+	long long *t = traceframes.time;
+
+	tracedump(0);
+	if (!tracefp)
+		return;
+	if (n) {
+		qsort(t, n, sizeof(*t), tracecmp);
+		fprintf(tracefp, "dmenu pid=%ld frames=%zu frame_p50=%lld frame_p90=%lld"
+		        " frame_p99=%lld frame_max=%lld requests=%.1f xft=%.1f\n",
+		        (long)getpid(), n, t[n / 2], t[n * 9 / 10], t[n * 99 / 100],
+		        t[n - 1], (double)traceframes.requests / n,
+		        (double)traceframes.xftcalls / n);
+	}
+	free(t);
+	if (tracefp != stderr)
+		fclose(tracefp);
+	else
+		fflush(tracefp);
+	tracefp = NULL;
+}
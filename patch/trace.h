@@ -0,0 +1,10 @@
+enum { TraceOpen, TraceXresources, TraceFonts, TraceStdin, TraceStdinWait,
+       TraceGrab, TraceFocus, TraceGeometry, TraceXinerama, TraceIM, TraceDraw,
+       TraceLast }; /* phases */
+
+static void tracebegin(int phase);
+static void traceend(int phase);
+static void tracedump(int expose);
+static void traceexit(void);
+static void traceframe(int end);
+static void tracebench(void);
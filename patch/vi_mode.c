@@ -26,8 +26,7 @@ vi_keypress(KeySym ksym, const XKeyEvent *ev)
 		case XK_p: /* fallthrough */
 		case XK_P: break;
 		case XK_c:
-			cleanup();
-			exit(1);
+			quit(1);
 		case XK_Return: /* fallthrough */
 		case XK_KP_Enter: break;
 		default: return;
@@ -81,13 +80,13 @@ vi_keypress(KeySym ksym, const XKeyEvent *ev)
 		break;
 	case XK_j:
 		if (sel && sel->right && (sel = sel->right) == next) {
-			curr = next;
+			curr = lines > 0 ? curr->right : next;
 			calcoffsets();
 		}
 		break;
 	case XK_k:
 		if (sel && sel->left && (sel = sel->left)->right == curr) {
-			curr = prev;
+			curr = lines > 0 ? sel : prev;
 			calcoffsets();
 		}
 		break;
@@ -132,6 +131,7 @@ vi_keypress(KeySym ksym, const XKeyEvent *ev)
 	/* deletion */
 	case XK_D:
 		text[cursor] = '\0';
+		textchanged(cursor);
 		if (cursor)
 			cursor = nextrune(-1);
 		match();
@@ -148,8 +148,7 @@ vi_keypress(KeySym ksym, const XKeyEvent *ev)
 	case XK_KP_Enter:
 		puts((sel && !(ev->state & ShiftMask)) ? sel->text : text);
 		if (!(ev->state & ControlMask)) {
-			cleanup();
-			exit(0);
+			quit(0);
 		}
 		if (sel)
 			sel->out = 1;
@@ -157,6 +156,7 @@ vi_keypress(KeySym ksym, const XKeyEvent *ev)
 	case XK_Tab:
 		if (!sel)
 			return;
+		textchanged(0);
 		strncpy(text, sel->text, sizeof text - 1);
 		text[sizeof text - 1] = '\0';
 		cursor = strlen(text) - 1;
@@ -166,11 +166,10 @@ vi_keypress(KeySym ksym, const XKeyEvent *ev)
 		for (size_t i = 0; i < quit_len; ++i)
 			if (quit_keys[i].ksym == ksym &&
 				(quit_keys[i].state & ev->state) == quit_keys[i].state) {
-				cleanup();
-				exit(1);
+				quit(1);
 			}
 	}
 
 draw:
-	drawmenu();
+	pendingdraw = 1;
 }
@@ -1,72 +1,1068 @@
 /* See LICENSE file for copyright and license details. */
+#include <sys/mman.h>
 #include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+#endif
 
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "arg.h"
+#include "util.h"
 char *argv0;
 
 #define FLAG(x)  (flag[(x)-'a'])
 
-static void test(const char *, const char *);
+/* one file argument, scanned by a worker into its own buffer */
+struct job {
+	const char *arg;
+	char *buf;
+	size_t len;
+	int match, done;
+};
+
+static void addname(const char *, size_t);
+static void addnames(const char *, size_t);
+static int scan(const char *, FILE *);
+static int test(int, const char *, const char *, int, FILE *);
 static void usage(void);
 
 static int match = 0;
 static int flag[26];
 static struct stat old, new;
+static int nworkers = 1, unordered = 0, sorted = 0;
+
+static struct job *jobs;
+static struct job **finished; /* jobs in the order they completed */
+static size_t njobs, nextjob, nfinished;
+static pthread_t *tids;
+static size_t ntids;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t completed = PTHREAD_COND_INITIALIZER;
+
+/* Decides the type flags from a d_type alone: 1 if they pass, 0 if they
+ * fail and -1 if the entry has to be looked at. */
+static int
+typetest(int type)
+{
+	mode_t mode;
+
+	switch (type) {
+	case DT_BLK:  mode = S_IFBLK;  break;
+	case DT_CHR:  mode = S_IFCHR;  break;
+	case DT_DIR:  mode = S_IFDIR;  break;
+	case DT_FIFO: mode = S_IFIFO;  break;
+	case DT_REG:  mode = S_IFREG;  break;
+	case DT_SOCK: mode = S_IFSOCK; break;
+	default:      return -1; /* symbolic link or unknown */
+	}
+	return !FLAG('h')
+	&& (!FLAG('b') || S_ISBLK(mode))
+	&& (!FLAG('c') || S_ISCHR(mode))
+	&& (!FLAG('d') || S_ISDIR(mode))
+	&& (!FLAG('f') || S_ISREG(mode))
+	&& (!FLAG('p') || S_ISFIFO(mode));
+}
+
+/* tests the flags against st, what path resolves to; islnk tells whether
+ * path itself is a symbolic link, or is -1 if that is not known yet */
+static int
+pass(int dirfd, const char *path, const struct stat *st, int islnk)
+{
+	struct stat ln;
+
+	return (!FLAG('b') || S_ISBLK(st->st_mode))                   /* block special     */
+	&& (!FLAG('c') || S_ISCHR(st->st_mode))                       /* character special */
+	&& (!FLAG('d') || S_ISDIR(st->st_mode))                       /* directory         */
+	&& (!FLAG('f') || S_ISREG(st->st_mode))                       /* regular file      */
+	&& (!FLAG('g') || st->st_mode & S_ISGID)                      /* set-group-id flag */
+	&& (!FLAG('h') || (islnk < 0                                  /* symbolic link     */
+	    ? !fstatat(dirfd, path, &ln, AT_SYMLINK_NOFOLLOW) && S_ISLNK(ln.st_mode) : islnk))
+	&& (!FLAG('n') || st->st_mtime > new.st_mtime)                /* newer than file   */
+	&& (!FLAG('o') || st->st_mtime < old.st_mtime)                /* older than file   */
+	&& (!FLAG('p') || S_ISFIFO(st->st_mode))                      /* named pipe        */
+	&& (!FLAG('r') || permitted(dirfd, path, st, R_OK))           /* readable          */
+	&& (!FLAG('s') || st->st_size > 0)                            /* not empty         */
+	&& (!FLAG('u') || st->st_mode & S_ISUID)                      /* set-user-id flag  */
+	&& (!FLAG('w') || faccessat(dirfd, path, W_OK, 0) == 0)       /* writable          */
+	&& (!FLAG('x') || permitted(dirfd, path, st, X_OK));          /* executable        */
+}
+
+/* tells whether name is left out as a hidden file, see -a */
+static int
+hidden(const char *name)
+{
+	return !FLAG('a') && name[0] == '.';
+}
+
+/* tests path, relative to dirfd; type is its d_type or DT_UNKNOWN */
+static int
+lookup(int dirfd, const char *path, const char *name, int type)
+{
+	struct stat st;
+	int t;
+
+	if (hidden(name))                                             /* hidden files      */
+		return 0;
+	if (!(t = typetest(type)))
+		return 0;
+	if (t > 0 && !FLAG('g') && !FLAG('n') && !FLAG('o') && !FLAG('r')
+	&& !FLAG('s') && !FLAG('u') && !FLAG('w') && !FLAG('x'))
+		return 1; /* the entry exists and its type is all that is asked */
+	return !fstatat(dirfd, path, &st, 0)                          /* exists            */
+	&& pass(dirfd, path, &st, type == DT_LNK ? 1 : -1);
+}
+
+static int
+report(int ok, const char *name, FILE *out)
+{
+	if (ok == FLAG('v'))
+		return 0;
+	if (FLAG('q'))
+		exit(0);
+	if (sorted && out == stdout) {
+		addname(name, strlen(name));
+		return 1;
+	}
+	fputs(name, out);
+	fputc('\n', out);
+	return 1;
+}
+
+static int
+test(int dirfd, const char *path, const char *name, int type, FILE *out)
+{
+	return report(lookup(dirfd, path, name, type), name, out);
+}
+
+/* tests arg, or with -l the contents of the directory arg */
+static int
+scan(const char *arg, FILE *out)
+{
+	struct dirent *d;
+	DIR *dir;
+	int fd, m = 0;
+
+	if (FLAG('l') && (dir = opendir(arg))) {
+		/* test directory contents */
+		fd = dirfd(dir);
+		while ((d = readdir(dir)))
+			m |= test(fd, d->d_name, d->d_name, d->d_type, out);
+		closedir(dir);
+	} else {
+		m = test(AT_FDCWD, arg, arg, DT_UNKNOWN, out);
+	}
+	return m;
+}
+
+static void *
+worker(void *unused)
+{
+	struct job *j;
+	FILE *out;
+
+	for (;;) {
+		pthread_mutex_lock(&lock);
+		j = nextjob < njobs ? &jobs[nextjob++] : NULL;
+		pthread_mutex_unlock(&lock);
+		if (!j)
+			return NULL;
+		if (!(out = open_memstream(&j->buf, &j->len))) {
+			perror("open_memstream");
+			exit(2);
+		}
+		j->match = scan(j->arg, out);
+		if (fclose(out)) {
+			perror("fclose");
+			exit(2);
+		}
+		pthread_mutex_lock(&lock);
+		j->done = 1;
+		finished[nfinished++] = j;
+		pthread_cond_signal(&completed);
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+/* starts min(njobs, nworkers) workers on jobs */
+static void
+startjobs(void)
+{
+	size_t i;
+
+	nextjob = nfinished = 0;
+	ntids = njobs < (size_t)nworkers ? njobs : (size_t)nworkers;
+	if (!(finished = calloc(njobs, sizeof(*finished))) ||
+	    !(tids = calloc(ntids, sizeof(*tids)))) {
+		perror("calloc");
+		exit(2);
+	}
+	for (i = 0; i < ntids; i++)
+		if (pthread_create(&tids[i], NULL, worker, NULL)) {
+			fputs("stest: cannot create thread\n", stderr);
+			exit(2);
+		}
+}
+
+/* waits for the i-th job in argument order, or with -U to complete */
+static struct job *
+waitjob(size_t i)
+{
+	struct job *j;
+
+	pthread_mutex_lock(&lock);
+	while (unordered ? i >= nfinished : !jobs[i].done)
+		pthread_cond_wait(&completed, &lock);
+	j = unordered ? finished[i] : &jobs[i];
+	pthread_mutex_unlock(&lock);
+	return j;
+}
+
+static void
+stopjobs(void)
+{
+	size_t i;
+
+	for (i = 0; i < ntids; i++)
+		pthread_join(tids[i], NULL);
+	free(tids);
+	free(finished);
+}
 
+/* Scans the arguments on a pool of workers. Each result is written out
+ * whole, in argument order or with -U as soon as it is complete, so a
+ * slow directory only holds up the ones after it. */
 static void
-test(const char *path, const char *name)
+scanall(int argc, char *argv[])
 {
-	struct stat st, ln;
+	struct job *j;
+	size_t i;
 
-	if ((!stat(path, &st) && (FLAG('a') || name[0] != '.')        /* hidden files      */
-	&& (!FLAG('b') || S_ISBLK(st.st_mode))                        /* block special     */
-	&& (!FLAG('c') || S_ISCHR(st.st_mode))                        /* character special */
-	&& (!FLAG('d') || S_ISDIR(st.st_mode))                        /* directory         */
-	&& (!FLAG('e') || access(path, F_OK) == 0)                    /* exists            */
-	&& (!FLAG('f') || S_ISREG(st.st_mode))                        /* regular file      */
-	&& (!FLAG('g') || st.st_mode & S_ISGID)                       /* set-group-id flag */
-	&& (!FLAG('h') || (!lstat(path, &ln) && S_ISLNK(ln.st_mode))) /* symbolic link     */
-	&& (!FLAG('n') || st.st_mtime > new.st_mtime)                 /* newer than file   */
-	&& (!FLAG('o') || st.st_mtime < old.st_mtime)                 /* older than file   */
-	&& (!FLAG('p') || S_ISFIFO(st.st_mode))                       /* named pipe        */
-	&& (!FLAG('r') || access(path, R_OK) == 0)                    /* readable          */
-	&& (!FLAG('s') || st.st_size > 0)                             /* not empty         */
-	&& (!FLAG('u') || st.st_mode & S_ISUID)                       /* set-user-id flag  */
-	&& (!FLAG('w') || access(path, W_OK) == 0)                    /* writable          */
-	&& (!FLAG('x') || access(path, X_OK) == 0)) != FLAG('v')) {   /* executable        */
-		if (FLAG('q'))
-			exit(0);
-		match = 1;
-		puts(name);
+	njobs = argc;
+	if (!(jobs = calloc(njobs, sizeof(*jobs)))) {
+		perror("calloc");
+		exit(2);
 	}
+	for (i = 0; i < njobs; i++)
+		jobs[i].arg = argv[i];
+	startjobs();
+	for (i = 0; i < njobs; i++) {
+		j = waitjob(i);
+		if (sorted)
+			addnames(j->buf, j->len);
+		else
+			fwrite(j->buf, 1, j->len, stdout);
+		free(j->buf);
+		match |= j->match;
+	}
+	stopjobs();
+	free(jobs);
+}
+
+/* the flags the results of -C depend on, see cacheload() in util.c */
+static char *
+cacheflags(void)
+{
+	static char f[27];
+	int i, n = 0;
+
+	for (i = 0; i < 26; i++)
+		if (flag[i])
+			f[n++] = 'a' + i;
+	f[n] = '\0';
+	return f;
+}
+
+/* With -S the names that pass are collected rather than printed. They
+ * are copied into one arena, deduplicated with an open addressing hash
+ * set of arena offsets, sorted with an MSD radix sort and written out in
+ * one go at exit. */
+static struct {
+	char *arena;
+	size_t len, size;
+	size_t *off, n, noff;  /* start of each name in the arena */
+	size_t *set, setsize;  /* index + 1 into off, or 0 */
+} names;
+
+static void *
+grow(void *p, size_t *size, size_t min, size_t elem)
+{
+	size_t n = *size ? *size : 64;
+
+	while (n < min)
+		n *= 2;
+	if (n == *size)
+		return p;
+	if (!(p = realloc(p, n * elem))) {
+		perror("realloc");
+		exit(2);
+	}
+	*size = n;
+	return p;
+}
+
+static size_t
+namehash(const char *s, size_t len)
+{
+	size_t h = 2166136261u;
+
+	while (len--)
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h;
+}
+
+static void
+addname(const char *s, size_t len)
+{
+	size_t h, i, j, mask;
+
+	if (names.n * 2 >= names.setsize) {
+		free(names.set);
+		names.setsize = names.setsize ? names.setsize * 2 : 1024;
+		if (!(names.set = calloc(names.setsize, sizeof(*names.set)))) {
+			perror("calloc");
+			exit(2);
+		}
+		mask = names.setsize - 1;
+		for (j = 0; j < names.n; j++) {
+			h = namehash(names.arena + names.off[j], strlen(names.arena + names.off[j]));
+			for (i = h & mask; names.set[i]; i = (i + 1) & mask)
+				;
+			names.set[i] = j + 1;
+		}
+	}
+	mask = names.setsize - 1;
+	for (i = namehash(s, len) & mask; names.set[i]; i = (i + 1) & mask) {
+		j = names.off[names.set[i] - 1];
+		if (!strncmp(names.arena + j, s, len) && !names.arena[j + len])
+			return; /* seen */
+	}
+	names.off = grow(names.off, &names.noff, names.n + 1, sizeof(*names.off));
+	names.arena = grow(names.arena, &names.size, names.len + len + 1, 1);
+	memcpy(names.arena + names.len, s, len);
+	names.arena[names.len + len] = '\0';
+	names.off[names.n] = names.len;
+	names.len += len + 1;
+	names.set[i] = ++names.n;
+}
+
+/* adds the newline terminated names in buf */
+static void
+addnames(const char *buf, size_t len)
+{
+	const char *p, *nl, *end = buf + len;
+
+	for (p = buf; p < end && (nl = memchr(p, '\n', end - p)); p = nl + 1)
+		addname(p, nl - p);
+}
+
+static void
+clearnames(void)
+{
+	names.n = names.len = 0;
+	if (names.set)
+		memset(names.set, 0, names.setsize * sizeof(*names.set));
+}
+
+/* sorts a by the bytes from depth d on */
+static void
+radixsort(char **a, char **tmp, size_t n, size_t d)
+{
+	size_t count[256] = { 0 }, pos[256], i, j;
+	char *t;
+
+	if (n < 32) {
+		for (i = 1; i < n; i++)
+			for (j = i; j && strcmp(a[j - 1] + d, a[j] + d) > 0; j--) {
+				t = a[j];
+				a[j] = a[j - 1];
+				a[j - 1] = t;
+			}
+		return;
+	}
+	for (i = 0; i < n; i++)
+		count[(unsigned char)a[i][d]]++;
+	for (i = 0, j = 0; i < 256; j += count[i++])
+		pos[i] = j;
+	for (i = 0; i < n; i++)
+		tmp[pos[(unsigned char)a[i][d]]++] = a[i];
+	memcpy(a, tmp, n * sizeof(*a));
+	/* bucket 0 holds the names that ended, they are equal */
+	for (i = 1, j = count[0]; i < 256; j += count[i++])
+		if (count[i] > 1)
+			radixsort(a + j, tmp, count[i], d + 1);
+}
+
+static void
+writeall(int fd, const char *buf, size_t len)
+{
+	ssize_t r;
+
+	for (; len; buf += r, len -= r)
+		if ((r = write(fd, buf, len)) < 0) {
+			perror("write");
+			exit(2);
+		}
+}
+
+/* writes the collected names sorted to fd, unless it is -1, and to the
+ * file tee, unless it is NULL */
+static void
+writenames(int fd, const char *tee)
+{
+	char **a, **tmp, *buf, *p, path[PATH_MAX];
+	size_t i, len;
+	int r;
+
+	if (!(a = calloc(names.n + 1, sizeof(*a))) ||
+	    !(tmp = calloc(names.n + 1, sizeof(*tmp))) ||
+	    !(p = buf = malloc(names.len + 1))) {
+		perror("calloc");
+		exit(2);
+	}
+	for (i = 0; i < names.n; i++)
+		a[i] = names.arena + names.off[i];
+	radixsort(a, tmp, names.n, 0);
+	for (i = 0; i < names.n; i++) {
+		len = strlen(a[i]);
+		memcpy(p, a[i], len);
+		p += len;
+		*p++ = '\n';
+	}
+	if (fd >= 0)
+		writeall(fd, buf, p - buf);
+
+	if (tee) {
+		r = snprintf(path, sizeof(path), "%s.%ld", tee, (long)getpid());
+		if (r < 0 || (size_t)r >= sizeof(path) ||
+		    (fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+			perror(tee);
+			exit(2);
+		}
+		writeall(fd, buf, p - buf);
+		if (close(fd) || rename(path, tee)) {
+			perror(tee);
+			unlink(path);
+			exit(2);
+		}
+	}
+	free(buf);
+	free(tmp);
+	free(a);
+}
+
+/* Tests the contents of the directory arguments through the cache at
+ * path and collects the names as with -S. */
+static void
+cached(const char *path, int argc, char *argv[])
+{
+	struct cacheent *ents;
+	char *data;
+	size_t i, n, nstale = 0;
+
+	if (!(ents = calloc(argc, sizeof(*ents)))) {
+		perror("calloc");
+		exit(2);
+	}
+	for (i = 0; i < (size_t)argc; i++) {
+		ents[i].arg = argv[i];
+		cachestat(&ents[i]);
+	}
+	data = cacheload(path, cacheflags(), ents, argc);
+
+	/* scan what the cache does not answer, on the workers */
+	for (i = 0; i < (size_t)argc; i++)
+		if (!ents[i].buf)
+			nstale++;
+	if (nstale) {
+		if (!(jobs = calloc(nstale, sizeof(*jobs)))) {
+			perror("calloc");
+			exit(2);
+		}
+		for (i = n = 0; i < (size_t)argc; i++)
+			if (!ents[i].buf)
+				jobs[n++].arg = ents[i].arg;
+		njobs = nstale;
+		startjobs();
+		stopjobs();
+		for (i = n = 0; n < nstale; i++) {
+			if (ents[i].buf)
+				continue;
+			ents[i].buf = jobs[n].buf;
+			ents[i].len = jobs[n++].len;
+		}
+		cachesave(path, cacheflags(), ents, argc);
+	}
+
+	for (i = 0; i < (size_t)argc; i++)
+		addnames(ents[i].buf, ents[i].len);
+	if (names.n && FLAG('q'))
+		exit(0);
+	match = names.n > 0;
+
+	for (i = 0; i < nstale; i++) /* not a part of data */
+		free(jobs[i].buf);
+	free(jobs);
+	free(data);
+	free(ents);
 }
 
 static void
 usage(void)
 {
-	fprintf(stderr, "usage: %s [-abcdefghlpqrsuvwx] "
-	        "[-n file] [-o file] [file...]\n", argv0);
+	fprintf(stderr, "usage: %s [-abcdefghlpqrsuvwxSU] "
+	        "[-C cache] [-I file] [-j jobs] [-n file] [-o file] [-T file] [file...]\n", argv0);
 	exit(2); /* like test(1) return > 1 on error */
 }
 
+/* A list from stdin is tested in batches: each path is looked up by one
+ * of the workers and the results are reported in input order. */
+#define BATCH 4096
+
+struct batch {
+	char *path[BATCH];
+	size_t size[BATCH];
+	int ok[BATCH];
+	size_t n, next;
+};
+
+static void *
+batchworker(void *arg)
+{
+	struct batch *b = arg;
+	size_t i;
+
+	for (;;) {
+		pthread_mutex_lock(&lock);
+		i = b->next++;
+		pthread_mutex_unlock(&lock);
+		if (i >= b->n)
+			return NULL;
+		b->ok[i] = lookup(AT_FDCWD, b->path[i], b->path[i], DT_UNKNOWN);
+	}
+}
+
+static void
+listpool(void)
+{
+	static struct batch b;
+	pthread_t tids[64];
+	ssize_t len;
+	size_t i, n;
+
+	n = nworkers < 64 ? nworkers : 64;
+	do {
+		for (b.n = 0; b.n < BATCH; b.n++) {
+			if ((len = getline(&b.path[b.n], &b.size[b.n], stdin)) <= 0)
+				break;
+			if (b.path[b.n][len - 1] == '\n')
+				b.path[b.n][len - 1] = '\0';
+		}
+		b.next = 0;
+		for (i = 0; i < n; i++)
+			if (pthread_create(&tids[i], NULL, batchworker, &b)) {
+				fputs("stest: cannot create thread\n", stderr);
+				exit(2);
+			}
+		for (i = 0; i < n; i++)
+			pthread_join(tids[i], NULL);
+		for (i = 0; i < b.n; i++)
+			match |= report(b.ok[i], b.path[i], stdout);
+	} while (b.n == BATCH);
+	for (i = 0; i < BATCH; i++)
+		free(b.path[i]);
+}
+
+#ifdef __linux__
+/* With io_uring the lookups of a list are statx requests, up to DEPTH in
+ * flight. Completions land in a ring of slots indexed by input line, and
+ * the oldest lines are reported as soon as they are complete. */
+#define DEPTH 256
+
+struct uring {
+	int fd;
+	unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+	unsigned *cqhead, *cqtail, *cqmask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned queued;
+};
+
+struct slot {
+	char *path;
+	size_t size;
+	struct statx stx, lstx;
+	int res, lres, pending;
+};
+
+static int
+uring_setup(struct uring *u)
+{
+	struct io_uring_params p;
+	struct io_uring_probe *probe;
+	size_t sqsz, cqsz;
+	char *sq, *cq;
+	int ok;
+
+	memset(&p, 0, sizeof(p));
+	if ((u->fd = syscall(__NR_io_uring_setup, 2 * DEPTH, &p)) < 0)
+		return -1;
+	/* statx needs Linux 5.6 */
+	if (!(probe = calloc(1, sizeof(*probe) + 256 * sizeof(probe->ops[0]))))
+		goto fail;
+	ok = syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PROBE, probe, 256) >= 0
+	     && probe->last_op >= IORING_OP_STATX
+	     && probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED;
+	free(probe);
+	if (!ok)
+		goto fail;
+
+	sqsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cqsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		sqsz = cqsz = sqsz > cqsz ? sqsz : cqsz;
+	sq = mmap(NULL, sqsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	          u->fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		cq = sq;
+	else if ((cq = mmap(NULL, cqsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                    u->fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+		goto fail;
+	u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+	               PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	               u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+		goto fail;
+	u->sqhead = (unsigned *)(sq + p.sq_off.head);
+	u->sqtail = (unsigned *)(sq + p.sq_off.tail);
+	u->sqmask = (unsigned *)(sq + p.sq_off.ring_mask);
+	u->sqarray = (unsigned *)(sq + p.sq_off.array);
+	u->cqhead = (unsigned *)(cq + p.cq_off.head);
+	u->cqtail = (unsigned *)(cq + p.cq_off.tail);
+	u->cqmask = (unsigned *)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	u->queued = 0;
+	return 0;
+fail:
+	close(u->fd);
+	return -1;
+}
+
+static void
+uring_statx(struct uring *u, struct slot *s, unsigned long long data, int nofollow)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail = *u->sqtail, i = tail & *u->sqmask;
+
+	sqe = &u->sqes[i];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_STATX;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (unsigned long)s->path;
+	sqe->off = (unsigned long)(nofollow ? &s->lstx : &s->stx);
+	sqe->len = STATX_BASIC_STATS;
+	sqe->statx_flags = nofollow ? AT_SYMLINK_NOFOLLOW : 0;
+	sqe->user_data = data;
+	u->sqarray[i] = i;
+	__atomic_store_n(u->sqtail, tail + 1, __ATOMIC_RELEASE);
+	u->queued++;
+	s->pending++;
+}
+
+static void
+listuring(struct uring *u)
+{
+	static struct slot slots[DEPTH];
+	struct io_uring_cqe *cqe;
+	struct slot *s;
+	struct stat st;
+	unsigned long long head = 0, tail = 0; /* next line to report, to read */
+	unsigned h;
+	ssize_t len;
+	int eof = 0, r;
+
+	for (;;) {
+		while (!eof && tail - head < DEPTH) {
+			s = &slots[tail % DEPTH];
+			if ((len = getline(&s->path, &s->size, stdin)) <= 0) {
+				eof = 1;
+				break;
+			}
+			if (s->path[len - 1] == '\n')
+				s->path[len - 1] = '\0';
+			if (hidden(s->path)) {
+				s->res = -1; /* fails as in lookup(), without a statx */
+			} else {
+				uring_statx(u, s, (tail % DEPTH) << 1, 0);
+				if (FLAG('h'))
+					uring_statx(u, s, (tail % DEPTH) << 1 | 1, 1);
+			}
+			tail++;
+		}
+		for (; head < tail && !(s = &slots[head % DEPTH])->pending; head++) {
+			if (s->res == 0) {
+				st.st_mode = s->stx.stx_mode;
+				st.st_uid = s->stx.stx_uid;
+				st.st_gid = s->stx.stx_gid;
+				st.st_size = s->stx.stx_size;
+				st.st_mtime = s->stx.stx_mtime.tv_sec;
+			}
+			match |= report(s->res == 0 && pass(AT_FDCWD, s->path, &st,
+			                FLAG('h') && s->lres == 0 && S_ISLNK(s->lstx.stx_mode)),
+			                s->path, stdout);
+		}
+		if (head == tail && eof)
+			break;
+		if (head == tail)
+			continue; /* a window of hidden files, nothing in flight */
+
+		r = syscall(__NR_io_uring_enter, u->fd, u->queued, 1,
+		            IORING_ENTER_GETEVENTS, NULL, 0);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("io_uring_enter");
+			exit(2);
+		}
+		u->queued -= r;
+
+		h = *u->cqhead;
+		for (; h != __atomic_load_n(u->cqtail, __ATOMIC_ACQUIRE); h++) {
+			cqe = &u->cqes[h & *u->cqmask];
+			s = &slots[cqe->user_data >> 1];
+			if (cqe->user_data & 1)
+				s->lres = cqe->res;
+			else
+				s->res = cqe->res;
+			s->pending--;
+		}
+		__atomic_store_n(u->cqhead, h, __ATOMIC_RELEASE);
+	}
+	for (h = 0; h < DEPTH; h++)
+		free(slots[h].path);
+}
+/* With -I stest stays resident and keeps file listing the contents of
+ * the directory arguments, as with -S. Each directory's names are kept
+ * in memory and inotify tells which entries to test again, so a change
+ * costs one lookup and a rewrite of file rather than a rescan. The parent
+ * of each directory is watched as well, for the directory to be removed
+ * or created; a missing parent is looked for once a second. */
+struct watch {
+	const char *path, *parent, *base;
+	int fd, wd, pwd;
+	char **names;
+	size_t n, size;
+};
+
+static volatile sig_atomic_t stopwatch;
+
+static void
+onsignal(int sig)
+{
+	stopwatch = 1;
+}
+
+/* adds or removes name from the names of w; returns whether it changed */
+static int
+watchset(struct watch *w, const char *name, int ok)
+{
+	size_t i;
+
+	for (i = 0; i < w->n && strcmp(w->names[i], name); i++)
+		;
+	if (ok == (i < w->n))
+		return 0;
+	if (!ok) {
+		free(w->names[i]);
+		w->names[i] = w->names[--w->n];
+		return 1;
+	}
+	w->names = grow(w->names, &w->size, w->n + 1, sizeof(*w->names));
+	if (!(w->names[w->n++] = strdup(name))) {
+		perror("strdup");
+		exit(2);
+	}
+	return 1;
+}
+
+static void
+watchscan(struct watch *w)
+{
+	struct dirent *d;
+	DIR *dir;
+	int fd;
+
+	while (w->n)
+		free(w->names[--w->n]);
+	if ((fd = dup(w->fd)) < 0 || !(dir = fdopendir(fd))) {
+		perror(w->path);
+		return;
+	}
+	rewinddir(dir); /* the offset is shared with w->fd, scanned before */
+	while ((d = readdir(dir)))
+		if (lookup(w->fd, d->d_name, d->d_name, d->d_type))
+			watchset(w, d->d_name, 1);
+	closedir(dir);
+}
+
+static void
+watchinit(struct watch *w, const char *path)
+{
+	char *s, *p;
+
+	w->path = path;
+	w->fd = w->wd = w->pwd = -1;
+	if (!(s = strdup(path))) {
+		perror("strdup");
+		exit(2);
+	}
+	for (p = s + strlen(s); p > s + 1 && p[-1] == '/'; )
+		*--p = '\0';
+	if (!(p = strrchr(s, '/'))) {
+		w->parent = ".";
+		w->base = s;
+	} else if (p == s) {
+		w->parent = "/";
+		w->base = p[1] ? p + 1 : ".";
+	} else {
+		*p = '\0';
+		w->parent = s;
+		w->base = p + 1;
+	}
+}
+
+/* starts watching the directory of w; returns whether it yielded names */
+static int
+watchopen(int ifd, struct watch *w)
+{
+	if ((w->fd = open(w->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+		return 0;
+	/* IN_MASK_ADD: a directory may also be the parent of another one */
+	if ((w->wd = inotify_add_watch(ifd, w->path, IN_CREATE | IN_DELETE |
+	                               IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB |
+	                               IN_CLOSE_WRITE | IN_DELETE_SELF |
+	                               IN_ONLYDIR | IN_MASK_ADD)) < 0) {
+		close(w->fd);
+		w->fd = -1;
+		return 0;
+	}
+	watchscan(w);
+	return w->n > 0;
+}
+
+static void
+watchclear(struct watch *w)
+{
+	while (w->n)
+		free(w->names[--w->n]);
+	if (w->fd >= 0)
+		close(w->fd);
+	w->fd = w->wd = -1;
+}
+
+static void
+watchwrite(struct watch *ws, size_t nws, const char *file)
+{
+	size_t i, j;
+
+	clearnames();
+	for (i = 0; i < nws; i++)
+		for (j = 0; j < ws[i].n; j++)
+			addname(ws[i].names[j], strlen(ws[i].names[j]));
+	writenames(-1, file);
+}
+
+/* handles the events in buf; returns whether a list changed */
+static int
+watchevents(int ifd, struct watch *ws, size_t nws, char *buf, ssize_t len)
+{
+	struct inotify_event *ev;
+	struct watch *w;
+	char *p;
+	size_t i;
+	int changed = 0;
+
+	for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+		ev = (struct inotify_event *)p;
+		if (ev->mask & IN_Q_OVERFLOW) {
+			/* events were lost, start over from the directories */
+			for (i = 0; i < nws; i++)
+				if (ws[i].wd >= 0)
+					watchscan(&ws[i]);
+			changed = 1;
+			continue;
+		}
+		/* the same directory may be given more than once, or be the
+		 * parent of another one */
+		for (i = 0; i < nws; i++) {
+			w = &ws[i];
+			if (w->pwd == ev->wd && ev->mask & IN_IGNORED) {
+				w->pwd = -1;
+			} else if (w->pwd == ev->wd && ev->len && !strcmp(ev->name, w->base) &&
+			           ev->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) {
+				/* the directory went away or was replaced */
+				changed |= w->n > 0;
+				watchclear(w);
+				if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+					changed |= watchopen(ifd, w);
+			}
+			if (w->wd != ev->wd)
+				continue;
+			/* a removed directory is seen in its parent first; this
+			 * is the removal of one that is no longer open */
+			if (ev->mask & (IN_DELETE_SELF | IN_IGNORED)) {
+				changed |= w->n > 0;
+				watchclear(w);
+			} else if (ev->len) {
+				changed |= watchset(w, ev->name, !(ev->mask & (IN_DELETE | IN_MOVED_FROM))
+				                    && lookup(w->fd, ev->name, ev->name, DT_UNKNOWN));
+			}
+		}
+	}
+	return changed;
+}
+
+/* watches the parents that are missing and opens the directories that
+ * appeared since; returns whether a list changed */
+static int
+watchretry(int ifd, struct watch *ws, size_t nws)
+{
+	size_t i;
+	int changed = 0;
+
+	for (i = 0; i < nws; i++) {
+		if (ws[i].pwd < 0)
+			ws[i].pwd = inotify_add_watch(ifd, ws[i].parent, IN_CREATE |
+			                              IN_DELETE | IN_MOVED_FROM |
+			                              IN_MOVED_TO | IN_ONLYDIR |
+			                              IN_MASK_ADD);
+		if (ws[i].wd < 0)
+			changed |= watchopen(ifd, &ws[i]);
+	}
+	return changed;
+}
+
+static void
+watch(const char *file, int argc, char *argv[])
+{
+	struct sigaction sa;
+	struct watch *ws;
+	struct pollfd pfd;
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	char pidfile[PATH_MAX];
+	ssize_t len;
+	size_t i;
+	int ifd, r, missing;
+
+	r = snprintf(pidfile, sizeof(pidfile), "%s.pid", file);
+	if (r < 0 || (size_t)r >= sizeof(pidfile))
+		usage();
+	if ((ifd = inotify_init1(IN_CLOEXEC)) < 0) {
+		perror("inotify_init1");
+		exit(2);
+	}
+	if (!(ws = calloc(argc, sizeof(*ws)))) {
+		perror("calloc");
+		exit(2);
+	}
+	for (i = 0; i < (size_t)argc; i++)
+		watchinit(&ws[i], argv[i]);
+	watchretry(ifd, ws, argc);
+	watchwrite(ws, argc, file);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = onsignal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+	if ((r = open(pidfile, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0) {
+		dprintf(r, "%ld\n", (long)getpid());
+		close(r);
+	}
+
+	pfd.fd = ifd;
+	pfd.events = POLLIN;
+	while (!stopwatch) {
+		for (i = 0, missing = 0; i < (size_t)argc; i++)
+			missing |= ws[i].pwd < 0;
+		if ((r = poll(&pfd, 1, missing ? 1000 : -1)) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+		if (!r) {
+			if (watchretry(ifd, ws, argc))
+				watchwrite(ws, argc, file);
+			continue;
+		}
+		if ((len = read(ifd, buf, sizeof(buf))) <= 0) {
+			if (len < 0 && errno == EINTR)
+				continue;
+			perror("read");
+			break;
+		}
+		r = watchevents(ifd, ws, argc, buf, len);
+		/* let a burst of changes, like a package install, settle */
+		while (!stopwatch && poll(&pfd, 1, 100) > 0 &&
+		       (len = read(ifd, buf, sizeof(buf))) > 0)
+			r |= watchevents(ifd, ws, argc, buf, len);
+		if (r)
+			watchwrite(ws, argc, file);
+	}
+	unlink(pidfile);
+	exit(0);
+}
+#endif
+
 int
 main(int argc, char *argv[])
 {
-	struct dirent *d;
-	char path[PATH_MAX], *line = NULL, *file;
+#ifdef __linux__
+	struct uring uring;
+#endif
+	char *line = NULL, *file, *cache = NULL, *tee = NULL, *watched = NULL;
 	size_t linesiz = 0;
 	ssize_t n;
-	DIR *dir;
-	int r;
 
 	ARGBEGIN {
+	case 'j': /* scan this many arguments at once */
+		if ((nworkers = atoi(EARGF(usage()))) < 1)
+			usage();
+		break;
+	case 'C': /* keep the results per argument in a cache */
+		cache = EARGF(usage());
+		break;
+#ifdef __linux__
+	case 'I': /* keep a file of the contents of the arguments fresh */
+		watched = EARGF(usage());
+		break;
+#endif
+	case 'S': /* print sorted and without duplicates */
+		sorted = 1;
+		break;
+	case 'T': /* and also write that to a file */
+		tee = EARGF(usage());
+		sorted = 1;
+		break;
+	case 'U': /* print results as they complete */
+		unordered = 1;
+		break;
 	case 'n': /* newer than file */
 	case 'o': /* older than file */
 		file = EARGF(usage());
@@ -81,29 +1077,40 @@ main(int argc, char *argv[])
 			usage(); /* unknown flag */
 	} ARGEND;
 
-	if (!argc) {
+	if (permitinit() < 0) {
+		perror("getgroups");
+		exit(2);
+	}
+
+	if (!argc && nworkers > 1) {
+#ifdef __linux__
+		if (!uring_setup(&uring))
+			listuring(&uring);
+		else
+#endif
+			listpool();
+	} else if (!argc) {
 		/* read list from stdin */
 		while ((n = getline(&line, &linesiz, stdin)) > 0) {
 			if (line[n - 1] == '\n')
 				line[n - 1] = '\0';
-			test(line, line);
+			match |= test(AT_FDCWD, line, line, DT_UNKNOWN, stdout);
 		}
 		free(line);
+#ifdef __linux__
+	} else if (watched) {
+		watch(watched, argc, argv);
+#endif
+	} else if (cache) {
+		sorted = 1;
+		cached(cache, argc, argv);
+	} else if (nworkers > 1 && argc > 1) {
+		scanall(argc, argv);
 	} else {
-		for (; argc; argc--, argv++) {
-			if (FLAG('l') && (dir = opendir(*argv))) {
-				/* test directory contents */
-				while ((d = readdir(dir))) {
-					r = snprintf(path, sizeof path, "%s/%s",
-					             *argv, d->d_name);
-					if (r >= 0 && (size_t)r < sizeof path)
-						test(path, d->d_name);
-				}
-				closedir(dir);
-			} else {
-				test(*argv, *argv);
-			}
-		}
+		for (; argc; argc--, argv++)
+			match |= scan(*argv, stdout);
 	}
+	if (sorted)
+		writenames(1, tee);
 	return match ? 0 : 1;
 }
@@ -1,11 +1,25 @@
 /* See LICENSE file for copyright and license details. */
+#ifdef __linux__
+#define _GNU_SOURCE /* struct ucred */
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
 
 #include "util.h"
 
+static uid_t uid;
+static gid_t gid, *groups;
+static int ngroups;
+
 void
 die(const char *fmt, ...)
 {
@@ -34,3 +48,195 @@ ecalloc(size_t nmemb, size_t size)
 		die("calloc:");
 	return p;
 }
+
+/* Writes the socket path of the dmenu daemon for $DISPLAY to buf:
+ * $DMENU_SOCKET if set, else a per-user file in $XDG_RUNTIME_DIR or /tmp. */
+int
+daemonpath(char *buf, size_t n)
+{
+	const char *dir, *disp, *p;
+	char *s;
+	int len;
+
+	if ((p = getenv("DMENU_SOCKET")) && *p)
+		return snprintf(buf, n, "%s", p) < (int)n ? 0 : -1;
+	if (!(dir = getenv("XDG_RUNTIME_DIR")) || !*dir)
+		dir = "/tmp";
+	if (!(disp = getenv("DISPLAY")))
+		disp = "";
+	len = snprintf(buf, n, "%s/dmenu-%ld-", dir, (long)getuid());
+	if (len < 0 || (size_t)len + strlen(disp) >= n)
+		return -1;
+	for (s = buf + len; *disp; disp++)
+		*s++ = *disp == '/' ? '_' : *disp;
+	*s = '\0';
+	return 0;
+}
+
+/* Tells whether the other end of the unix socket fd runs as our user, the
+ * daemon socket may live in a directory anyone can write to. */
+int
+samepeer(int fd)
+{
+#ifdef __linux__
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	return !getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) &&
+	       cred.uid == geteuid();
+#else
+	uid_t uid;
+	gid_t gid;
+
+	return !getpeereid(fd, &uid, &gid) && uid == geteuid();
+#endif
+}
+
+/* Reads the real user and groups permitted() decides for; has to be called
+ * before threads use permitted(). Returns -1 if getgroups() fails. */
+int
+permitinit(void)
+{
+	static int done;
+	int n;
+
+	if (done)
+		return 0;
+	uid = getuid();
+	gid = getgid();
+	if ((n = getgroups(0, NULL)) > 0 &&
+	    (!(groups = calloc(n, sizeof(*groups))) ||
+	    (n = getgroups(n, groups)) < 0))
+		return -1;
+	ngroups = n < 0 ? 0 : n;
+	done = 1;
+	return 0;
+}
+
+static int
+ingroup(gid_t g)
+{
+	int i;
+
+	if (g == gid)
+		return 1;
+	for (i = 0; i < ngroups; i++)
+		if (groups[i] == g)
+			return 1;
+	return 0;
+}
+
+/* Decides access from the mode bits as access(2) does for the real user.
+ * A denial is left to faccessat(), an ACL or capability may still grant. */
+int
+permitted(int dirfd, const char *path, const struct stat *st, int mode)
+{
+	mode_t bits;
+
+	if (uid == 0)
+		return mode != X_OK || S_ISDIR(st->st_mode) || (st->st_mode & 0111);
+	if (st->st_uid == uid)
+		bits = st->st_mode >> 6;
+	else if (ingroup(st->st_gid))
+		bits = st->st_mode >> 3;
+	else
+		bits = st->st_mode;
+	if ((bits & mode) == (mode_t)mode)
+		return 1;
+	return faccessat(dirfd, path, mode, 0) == 0;
+}
+
+/* The cache of stest -C keeps the names each directory argument yielded
+ * along with its mtime, and only directories whose mtime changed are
+ * scanned again. An argument that does not exist is kept with mtime -1
+ * and stays fresh for as long as it is missing. A changed flag set
+ * invalidates the whole cache. Its format is a "stest-cache 1 flags"
+ * line, then for every directory a "mtime-sec mtime-nsec length path"
+ * line followed by length bytes of names. */
+void
+cachestat(struct cacheent *e)
+{
+	struct stat st;
+
+	e->buf = NULL;
+	e->len = 0;
+	if (!stat(e->arg, &st)) {
+		e->sec = st.st_mtim.tv_sec;
+		e->nsec = st.st_mtim.tv_nsec;
+	} else {
+		e->sec = errno == ENOENT ? -1 : -2; /* -2: not cached */
+		e->nsec = 0;
+	}
+}
+
+/* Reads the cache at path into the entries whose mtime still matches,
+ * their buf points into the returned data. */
+char *
+cacheload(const char *path, const char *flags, struct cacheent *e, size_t n)
+{
+	FILE *fp;
+	struct stat st;
+	char *data, *p, *end, *nl, hdr[64];
+	long long sec;
+	long nsec;
+	size_t len, i;
+	int off;
+
+	if (!(fp = fopen(path, "r")))
+		return NULL;
+	if (fstat(fileno(fp), &st) || !(data = malloc(st.st_size + 1))) {
+		fclose(fp);
+		return NULL;
+	}
+	len = fread(data, 1, st.st_size, fp);
+	fclose(fp);
+	data[len] = '\0';
+	end = data + len;
+
+	snprintf(hdr, sizeof(hdr), "stest-cache 1 %s\n", flags);
+	if (strncmp(data, hdr, strlen(hdr)))
+		return data;
+	for (p = data + strlen(hdr); p < end; p = nl + 1 + len) {
+		if (!(nl = memchr(p, '\n', end - p)))
+			break;
+		*nl = '\0';
+		if (sscanf(p, "%lld %ld %zu %n", &sec, &nsec, &len, &off) != 3 ||
+		    len > (size_t)(end - nl - 1))
+			break;
+		/* a change within the second the cache was written may not
+		 * have moved the mtime, such a directory is scanned again */
+		if (sec >= st.st_mtim.tv_sec)
+			continue;
+		for (i = 0; i < n; i++) {
+			if (e[i].buf || strcmp(e[i].arg, p + off) ||
+			    e[i].sec != sec || e[i].nsec != nsec)
+				continue;
+			e[i].buf = nl + 1;
+			e[i].len = len;
+			break;
+		}
+	}
+	return data;
+}
+
+void
+cachesave(const char *path, const char *flags, const struct cacheent *e, size_t n)
+{
+	char tmp[PATH_MAX];
+	FILE *fp;
+	size_t i;
+	int r;
+
+	r = snprintf(tmp, sizeof(tmp), "%s.%ld", path, (long)getpid());
+	if (r < 0 || (size_t)r >= sizeof(tmp) || !(fp = fopen(tmp, "w")))
+		return;
+	fprintf(fp, "stest-cache 1 %s\n", flags);
+	for (i = 0; i < n; i++) {
+		if (e[i].sec < -1)
+			continue;
+		fprintf(fp, "%lld %ld %zu %s\n", e[i].sec, e[i].nsec, e[i].len, e[i].arg);
+		fwrite(e[i].buf, 1, e[i].len, fp);
+	}
+	if (fclose(fp) || rename(tmp, path))
+		unlink(tmp);
+}
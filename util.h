@@ -9,5 +9,23 @@
 #define BETWEEN(X, A, B)        ((A) <= (X) && (X) <= (B))
 #define LENGTH(X)               (sizeof (X) / sizeof (X)[0])
 
+struct stat;
+
+/* one argument of a stest -C cache, see cacheload() */
+struct cacheent {
+	const char *arg;
+	long long sec; /* mtime, -1 if arg does not exist, -2 if not cached */
+	long nsec;
+	char *buf;     /* names yielded, NULL if the cache does not know */
+	size_t len;
+};
+
 void die(const char *fmt, ...);
 void *ecalloc(size_t nmemb, size_t size);
+int daemonpath(char *buf, size_t n);
+int samepeer(int fd);
+int permitinit(void);
+int permitted(int dirfd, const char *path, const struct stat *st, int mode);
+void cachestat(struct cacheent *e);
+char *cacheload(const char *path, const char *flags, struct cacheent *e, size_t n);
+void cachesave(const char *path, const char *flags, const struct cacheent *e, size_t n);